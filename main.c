@@ -7,7 +7,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
-#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "matrixcalc.h"
 
 /*
  This program, 'matrix_calc.c', has the ability to perform multiple different operations on one or more input matrices.
@@ -33,10 +41,11 @@
 
  Checks will be run on the input matrices to make sure that the selected operations are able to run.
  If not an error message will be displayed.
+
+ The matrices are read, written and operated on by libmatrixcalc, in matrixcalc.c, which returns errors to
+ this file rather than printing them. This file gives the messages and exits.
 */
 
-static const char * VERSION  = "1.0.1";
-static const char * REV_DATE = "30-Oct-2019";
 
 /* Defined variables used within the code. */
 #define OPERATION_ARGUMENT 1
@@ -48,34 +57,92 @@ static const char * REV_DATE = "30-Oct-2019";
 #define MAX_ARGS_t_a_i 4
 #define MIN_ARGS_m 4
 #define MAX_ARGS_m 5
-#define MAX_LINE_LENGTH 40000 /* Maximum line length taken from file. */
-#define MAX_ROWS_COLS 2000 /* Maximum size of matrix in file. */
-#define TOKEN_SEPARATORS " \t\r\n" /* All string separators expected in file. */
-
-/* Constants for giving out errors. */
-typedef enum error{
-    NO_ERROR = 0,
-    INCORRECT_ARGUMENTS = 1,
-    MEMORY_ERROR = 2,
-    FILE_OPEN_ERROR = 3,
-    INVALID_FILE = 4,
-    INVALID_MATRIX = 5,
-} Error;
-
-/* Structure to give context to the error when program is exited. */
-typedef struct context{
-    FILE *file;
+#define JOB_SEPARATORS " \t\r\n" /* Characters separating the tokens of a line of a batch job file. */
+
+/* Defined values for the protocol of the server started with --serve. Each request is a header of
+ * SERVE_HEADER_SIZE bytes, followed by a payload of the length it gives:
+ *     bytes 0-3    command, one of SERVE_LOAD to SERVE_SHUTDOWN
+ *     bytes 4-7    reserved, 0
+ *     bytes 8-15   length of the payload
+ * Each reply has the same header, with an Error in place of the command. When it is not NO_ERROR, the payload
+ * is a message saying why. All values are little-endian, and matrices are referred to by 8 byte handles.
+ *     SERVE_LOAD       payload: file name                   reply: handle, rows, cols
+ *     SERVE_PUT        payload: text or binary matrix file  reply: handle, rows, cols
+ *     SERVE_GET        payload: handle                      reply: binary matrix file
+ *     SERVE_STORE      payload: handle, 4 byte format (0 text, 1 binary), 4 reserved bytes, file name
+ *     SERVE_OPERATION  payload: 4 byte operation ('f', 't', 'm', 'd', 'a' or 'i'), 4 reserved bytes, handle,
+ *                      second handle for 'm'
+ *                      reply: the norm or determinant as a double, or handle, rows, cols of a new matrix
+ *     SERVE_FREE       payload: handle
+ *     SERVE_SHUTDOWN   stops the server once the reply is sent */
+#define SERVE_HEADER_SIZE 16
+#define SERVE_MAX_PAYLOAD (256 << 20) /* Largest request accepted, enough for any text matrix file in practice. */
+#define SERVE_MESSAGE_LENGTH 512 /* Longest error message sent in a reply. */
+#define SERVE_LOAD 1
+#define SERVE_PUT 2
+#define SERVE_GET 3
+#define SERVE_STORE 4
+#define SERVE_OPERATION 5
+#define SERVE_FREE 6
+#define SERVE_SHUTDOWN 7
+
+/* Structure for loading a matrix on a thread of its own. */
+typedef struct load_task{
     char *file_name;
-    char *token;
+    Matrix *matrix;
+    Context context;
+    Error error;
+} LoadTask;
+
+/* Structure to hold the options given on the command line, before the operation and its files. */
+typedef struct options{
+    int threads;
+    int strassen; /* Whether large square products use Strassen-Winograd instead of the classical kernel. */
+    int strassen_cutoff; /* Size below which Strassen-Winograd uses the classical kernel. */
+    int binary_output; /* Whether output matrices are written in the binary format instead of text. */
+    int stream; /* Whether the frobenius norm is found while reading the file, without storing the matrix. */
+    int placement; /* How large matrices are placed in memory, any of the PLACE_ flags. */
+    char *batch_file; /* File of jobs to run instead of an operation from the command line, or NULL. */
+    char *socket_path; /* Unix domain socket to serve requests on instead of running an operation, or NULL. */
+} Options;
+
+/* Structure for one line of a batch job file, an operation and its files as they would be given on the
+ * command line. argv[0] is the program name, so argv is laid out the same as main()'s. */
+typedef struct job{
     int line_number;
-} Context;
-
-/* Structure to hold information about a matrix. */
-typedef struct matrix{
-    int rows;
-    int cols;
-    double *values;
-} Matrix;
+    int argc;
+    char *argv[MAX_ARGS_m + 1];
+    char *text; /* The line, split into its tokens with a '\0' after each, which argv points into. */
+    char operation;
+    const LoadTask *inputs[2];
+    Error error;
+    const char *message; /* Why the job failed, if error is not NO_ERROR. */
+    double value; /* The frobenius norm or determinant, for -f and -d. */
+    int swapped; /* Whether the inputs of a product were swapped to find it. */
+} Job;
+
+/* Structure for running the jobs of a batch between the threads of the pool, a job for each task. */
+typedef struct batch_task{
+    Job *jobs;
+    const Options *options;
+} BatchTask;
+
+/* Structure for a matrix kept in memory by the server, with its LU factorisation once one has been needed,
+ * so later operations on the same matrix do not factorise it again. */
+typedef struct resident{
+    Matrix *matrix;
+    LU *lu;
+} Resident;
+
+/* Structure for the state of the server. A matrix's handle is its index in residents plus 1, and the
+ * entries of freed matrices have a NULL matrix until they are used again. */
+typedef struct server{
+    Resident *residents;
+    int resident_count;
+    char *comment[3]; /* Command line written in the comment of text files stored by the server. */
+    const Options *options;
+    int stop;
+} Server;
 
 /* Function to print out help for stating appropriate command line arguments. */
 void help(char *argv[]){
@@ -88,6 +155,20 @@ void help(char *argv[]){
             "'-a': Adjoint : ./matrix_calc -a input_file (output_file)\n"
             "'-i': Inverse : ./matrix_calc -i input_file (output_file)\n\n");
     fprintf(stderr, "The (output file) is optional. If no file is given the matrix will be written to stdout.\n\n");
+    fprintf(stderr, "These options can be given before the operation:\n"
+            "'--threads N': Number of threads used for large matrices, all cores by default.\n"
+            "'--strassen': Use the Strassen-Winograd algorithm for large square matrix products.\n"
+            "'--strassen-cutoff N': Size below which Strassen-Winograd uses the classical product, %d by default.\n"
+            "'--format bin|text': Format of the output matrix, text by default. Binary output needs an output file.\n"
+            "'--stream': Find the frobenius norm while reading the file, without storing the matrix, so it can be any size.\n"
+            "'--huge-pages': Allocate large matrices in transparent huge pages, so products miss the TLB less often.\n"
+            "'--first-touch': Zero large matrices on all the threads as they are allocated, so on machines with more than\n"
+            "                 one memory node their pages are placed near the threads that use them.\n"
+            "'--batch job_file': Run each line of job_file as an operation and its files, such as '-m a.txt b.txt c.txt',\n"
+            "                    instead of one operation. Files used by many jobs are only read once.\n"
+            "'--serve socket_path': Keep matrices in memory and serve requests for operations on them over a Unix\n"
+            "                       domain socket, instead of running one operation.\n\n",
+            STRASSEN_CUTOFF);
 }
 
 /* Function to exit program and give an error when malloc fails. */
@@ -102,389 +183,98 @@ void exit_open_failed(const char *file_name){
     exit(FILE_OPEN_ERROR);
 }
 
-/* Function to exit program, close the file being read and give an error
- * message when the file being read is invalid. */
-void exit_invalid_file(Context *context, const char *message){
-    fprintf(stderr, "%s is an invalid matrix file. %s\n", context->file_name, message);
-    fprintf(stderr, "The invalid string in line %d of the file is\n%s\n", context->line_number, context->token);
-
-    fclose(context->file);
-    exit(INVALID_FILE);
-}
-
-/* Function to create and allocate memory for a structure storing a matrix. */
-Matrix *create_matrix(const int rows, const int cols){
-    /* Allocates memory for the matrix structure. */
-    Matrix *matrix = malloc(sizeof(Matrix));
-    if (matrix == NULL) {
-        exit_malloc_failed();
-    }
-
-    matrix->rows = rows;
-    matrix->cols = cols;
-
-    /* Allocates memory for the array of matrix elements. */
-    matrix->values = malloc(sizeof(double) * rows * cols);
-    if (matrix->values == NULL) {
-        exit_malloc_failed();
-    }
-
-    return matrix;
-}
-
-/* Function to free the memory used to store a matrix in a Matrix structure. */
-void free_matrix(Matrix *matrix){
-    free(matrix->values);
-    free(matrix);
-}
-
-/* Function to read a line of a file, skipping any that are blank or start with a #. */
-char *read_line(char *line, Context *context){
-    context->line_number++;
-
-    /* Gets a new line from the file as a string, it returns NULL if the line is too long and exits. */
-    if (fgets(line, MAX_LINE_LENGTH, context->file) == NULL) {
-        exit_invalid_file(context, "");
-    }
-
-    /* Gets the first token in the line string. Separates the first string from
-     * rest of the line by replacing whitespace with '\0'. */
-    context->token = strtok(line, TOKEN_SEPARATORS);
-    /* Will get the next line if first token is NULL or a '#'. */
-    if (context->token == NULL || context->token[0] == '#'){
-        read_line(line, context);
+/* Function to give an error message when the file that was read is invalid. */
+void print_invalid_file(const Context *context){
+    if (context->binary){
+        fprintf(stderr, "%s is an invalid binary matrix file. %s\n", context->file_name, context->message);
+        return;
     }
-    /* Also sets and returns the first token as the token used in the error context message.*/
-    return context->token;
-}
-
-/* Function to get the next token in a line of separated strings. */
-char *get_new_token(Context *context){
-    /* Sets the new token as the error context token. */
-    context->token = strtok(NULL, TOKEN_SEPARATORS);
-    return context->token;
-}
 
-/* Function to turn a string into an int, usually to find the rows and cols of a matrix. */
-int get_int(const char *token, Context *context){
-    char *end_ptr;
-    /* Use strtol to change a string to a long. */
-    long value = strtol(token, &end_ptr, 10);
-
-    /* Checks that there are no more characters after the value, using the end_ptr.
-     * And that the value is valid. */
-    if (*end_ptr != '\0' || value < 1){
-        exit_invalid_file(context, "Stated rows or columns are invalid.");
+    fprintf(stderr, "%s is an invalid matrix file. %s\n", context->file_name, context->message);
+    if (context->invalid_token_length >= 0){
+        fprintf(stderr, "The invalid string in line %d of the file is\n%.*s\n", context->line_number,
+                context->invalid_token_length, context->invalid_token);
     }
-    if (value > MAX_ROWS_COLS){
-        exit_invalid_file(context, "Rows or columns of the matrix are bigger than the maximum value allowed.");
+    else {
+        fprintf(stderr, "The invalid string in line %d of the file is\n(null)\n", context->line_number);
     }
-
-    /* Returns the value as an int. */
-    return (int) value;
 }
 
-/* Function to turn a string into a double, usually for finding an element in a matrix array. */
-double get_double(const char *token, Matrix *matrix, Context *context){
-    char *end_ptr;
-    /* Using strtod to change a string to a double. */
-    double value = strtod(token, &end_ptr);
-
-    /* Checks that there are no more characters after the value, using the end_ptr. */
-    if (*end_ptr != '\0'){
-        free_matrix(matrix);
-        exit_invalid_file(context, "Matrix element is invalid.");
-    }
-
-    return value;
+/* Function to exit program and give an error message when the file that was read is invalid. */
+void exit_invalid_file(const Context *context){
+    print_invalid_file(context);
+    exit(INVALID_FILE);
 }
 
-/* Function to find the rows and columns of a matrix from the file. */
-void read_rows_cols(int *rows, int *cols, char *token, Context *context){
-    /* Checks to make sure the first word of the first relevant line of the file is 'matrix'. */
-    if (strcmp(token, "matrix") != 0) {
-        exit_invalid_file(context, "");
+/* Function to give the messages for a matrix loaded by load_matrix(), exiting with an error message if it
+ * could not be loaded. */
+Matrix *check_loaded_matrix(const Error error, Matrix *matrix, const Context *context){
+    if (error == FILE_OPEN_ERROR){
+        exit_open_failed(context->file_name);
     }
 
-    token = get_new_token(context);
-    *rows = get_int(token, context);
-
-    token = get_new_token(context);
-    *cols = get_int(token, context);
+    printf("Processing file...\n");
 
-    /* Retrieves the next token and checks that its the end of the line. */
-    token = get_new_token(context);
-    if (token != NULL && *token != '#') {
-        exit_invalid_file(context, "There are unexpected characters in the file.");
+    if (error == MEMORY_ERROR){
+        exit_malloc_failed();
     }
-}
-
-/* Function to create the matrix array with values from a file. */
-void read_array(char *line, char *token, Matrix *matrix, Context *context){
-    for (int i=0; i<matrix->rows; i++) {
-        token = read_line(line, context);
-
-        /* Loops finding matrix elements for as many columns and rows stated in the file. */
-        for (int j=0; j<matrix->cols; j++) {
-            /* Checks that there is another matrix element when expected. */
-            if (token == NULL) {
-                free_matrix(matrix);
-                exit_invalid_file(context, "Number of stated columns does not match file.");
-            }
-            /* Checks that the next token isn't the end of the file. */
-            if (strcmp(token, "end") == 0){
-                free_matrix(matrix);
-                exit_invalid_file(context, "Number of stated rows does not match file.");
-            }
-
-            matrix->values[i*matrix->cols + j] = get_double(token, matrix, context);
-            token = get_new_token(context);
-
-        }
-        /* Checks that there are no more strings when not expected, but allows comments. */
-        if (token != NULL && *token != '#') {
-            free_matrix(matrix);
-            exit_invalid_file(context, "Unexpected characters in the file.");
-        }
+    if (error == INVALID_FILE){
+        exit_invalid_file(context);
     }
-}
 
-/* Function to find the end of a file. */
-void read_file_end(char *line, char *token, Matrix *matrix, Context *context){
-    token = read_line(line, context);
-
-    /* Checks that the last line in the file contains the word 'end'. */
-    if (strcmp(token, "end") != 0) {
-        free_matrix(matrix);
-        exit_invalid_file(context, "Could not find the end of the file.");
-    }
-    /* Checks that there are no more strings when not expected, but allows comments. */
-    token = get_new_token(context);
-    if (token != NULL && *token != '#') {
-        free_matrix(matrix);
-        exit_invalid_file(context, "Unexpected characters in the file.");
-    }
+    return matrix;
 }
 
-/* Function used to call all other functions used to read a matrix from a file. */
+/* Function used to call all other functions used to read a matrix from a file, exiting with an error
+ * message if it cannot be read. */
 Matrix *read_matrix(char *file_name){
-    FILE *f;
-    char line[MAX_LINE_LENGTH];
-    char *token;
-    int rows, cols;
-
-    f = fopen(file_name, "r");
-    if (f == NULL){
-        exit_open_failed(file_name);
-    }
-
-    printf("Processing file...\n");
+    Matrix *matrix = NULL;
 
-    /* Creates a context structure for error in reading the file. Sets the file and file name. */
+    /* Creates a context structure for error in reading the file. */
     Context file_context;
-    file_context.file = f;
-    file_context.file_name = file_name;
+    Error error = load_matrix(file_name, &matrix, &file_context);
 
-    token = read_line(line, &file_context);
-
-    read_rows_cols(&rows, &cols, token, &file_context);
-
-    Matrix *matrix = create_matrix(rows, cols);
-
-    read_array(line, token, matrix, &file_context);
-
-    read_file_end(line, token, matrix, &file_context);
-
-    fclose(f);
-    return matrix;
-}
-
-/* Function to print a matrix to a console, mainly used for testing the program. */
-void print_matrix(const Matrix *matrix){
-    for (int i=0; i<matrix->rows; i++){
-        for (int j=0; j<matrix->cols; j++){
-            printf("%.12g\t", matrix->values[i*(matrix->cols) + j]);
-        }
-        printf("\n");
-    }
-    printf("\n");
-}
-
-/* Function to calculate and return the frobenius norm of a matrix. */
-double get_frob_norm(const Matrix *matrix){
-    double frob_norm = 0;
-
-    for (int i=0; i<(matrix->rows*matrix->cols); i++){
-        /* Quicker way to cycle through the matrix is only using one variable.
-         * Works in this case as where the value is does not matter to us. */
-        frob_norm += pow(matrix->values[i], 2);
-    }
-
-    /* Returns the square root of the summed value of each matrix element squared. */
-    return pow(frob_norm, 0.5);
+    return check_loaded_matrix(error, matrix, &file_context);
 }
 
-/* Function to find the transpose of a matrix. */
-Matrix *get_transpose(const Matrix *matrix){
-    /* Creates new matrix to return from the function. */
-    Matrix *new_mat = create_matrix(matrix->cols, matrix->rows);
-
-    /* Loops to cycle through the matrix and put into correct position for transpose matrix. */
-    for (int i=0; i<new_mat->cols; i++){
-        for (int j=0; j<new_mat->rows; j++){
-            new_mat->values[j*(new_mat->cols)+i] = matrix->values[i*(matrix->cols)+j];
-        }
-    }
-
-    return new_mat;
+/* Function run on a thread of its own by read_matrices(), to load the second matrix. */
+void *load_matrix_thread(void *arg){
+    LoadTask *task = arg;
+    task->error = load_matrix(task->file_name, &task->matrix, &task->context);
+    return NULL;
 }
 
-/* Function to calculate the product of two matrices. */
-Matrix *get_product(const Matrix *matrix1, const Matrix *matrix2) {
-    double sum = 0;
-    Matrix *new_mat = create_matrix(matrix1->rows, matrix2->cols);
+/* Function to read two matrices from files at the same time, the second on a thread of its own, so reading
+ * takes as long as the slower file rather than both. Whichever starts first uses the pool to parse a large
+ * text file, and the other is parsed by its own thread. Messages and errors are given in the same order as
+ * when the files are read one after the other. */
+void read_matrices(char *file_name1, char *file_name2, Matrix **matrix1, Matrix **matrix2){
+    LoadTask second;
+    second.file_name = file_name2;
+    second.matrix = NULL;
 
-    /* Using 3 loops to multiply column of the first matrix by row of second matrix. */
-    for (int k = 0; k < new_mat->rows; k++) {
-        for (int i = 0; i < new_mat->cols; i++) {
-            for (int j = 0; j < matrix1->cols; j++) {
-                sum += matrix1->values[k * (matrix1->cols) + j] * matrix2->values[j * (matrix2->cols) + i];
-            }
-            new_mat->values[k * new_mat->cols + i] = sum;
-            /* Sets sum to 0 before calculating the next matrix element of product. */
-            sum = 0;
-        }
-    }
+    pthread_t thread;
+    const int threaded = pthread_create(&thread, NULL, load_matrix_thread, &second) == 0;
 
-    return new_mat;
-}
+    Matrix *first = NULL;
+    Context first_context;
+    Error error = load_matrix(file_name1, &first, &first_context);
 
-/* Recursive function to find the determinant of an nxn matrix, where n>2. */
-double find_det(const Matrix *matrix){
-    /* Returns determinant if matrix is 2x2. */
-    if (matrix->rows == 2){
-        return matrix->values[0]*matrix->values[3] - matrix->values[1]*matrix->values[2];
+    if (threaded){
+        pthread_join(thread, NULL);
     }
-
-    /* Creates sub matrix if incoming matrix is bigger than 2x2. */
-    Matrix *sub_mat = create_matrix(matrix->rows-1, matrix->cols-1);
-    double det = 0;
-
-    /* Finding the minor for each element in top row. */
-    for (int top_row=0; top_row<matrix->cols; top_row++){
-        int k=0;
-        /* i starts at 1 as we will not make the sub matrix with the top row. */
-        for (int i=1; i<matrix->rows; i++){
-            for (int j=0; j<matrix->cols; j++){
-                /* Check to make sure that any values in column of top row
-                 * element being used are not put into sub matrix. */
-                if (j != top_row){
-                    /* Easier cycling through of a matrix just using one value. */
-                    sub_mat->values[k] = matrix->values[i*matrix->cols+j];
-                    /* Manually go to next value as it cannot be in a for loop. */
-                    k++;
-                }
-            }
-        }
-        /* Determinant of each minor is calculated.
-         * Recursively calling itself until input matrix is 2x2. */
-        det += pow(-1, top_row) * matrix->values[top_row] * find_det(sub_mat);
+    else {
+        load_matrix_thread(&second);
     }
 
-    free_matrix(sub_mat);
-    return det;
-}
-
-/* Function to return the determinant of any matrix. Used in other operations too. */
-double get_determinant(const Matrix *matrix){
-    /* Returns only value in matrix if 1x1 matrix. */
-    if (matrix->rows == 1){
-        return matrix->values[0];
+    if (error != NO_ERROR && second.error == NO_ERROR){
+        free_matrix(second.matrix);
     }
-    /* If not 1x1, uses recursive function. */
-    double det = find_det(matrix);
-
-    return det;
-}
-
-/* Function to find the cofactor matrix of a matrix. */
-Matrix *find_cofactor(const Matrix *matrix){
-    Matrix *new_mat = create_matrix(matrix->rows, matrix->cols);
-
-    /* Looping through each element in original matrix, to find that elements cofactor. */
-    for (int i=0; i<matrix->rows; i++){
-        for (int j=0; j<matrix->cols; j++) {
-            /* Creates matrix for minor matrix of each element. */
-            Matrix *minor_mat = create_matrix(matrix->rows-1, matrix->cols-1);
-
-            double cofactor = 0;
-            int k=0;
-
-            /* Loop to create minor matrix. */
-            for (int m=0; m<matrix->rows; m++){
-                for (int n=0; n<matrix->cols; n++){
-
-                    if (n != j && m != i){
-                        minor_mat->values[k] = matrix->values[m*matrix->cols+n];
-                        k++;
-                    }
-
-                }
-            }
-            /* Calculates determinant of minor matrix for origianl matrix
-             * element and puts value into cofactor matrix. */
-            cofactor = pow(-1, i+j) * get_determinant(minor_mat);
-            new_mat->values[i*new_mat->cols+j] = cofactor;
-
-            free_matrix(minor_mat);
-        }
+    *matrix1 = check_loaded_matrix(error, first, &first_context);
+    if (second.error != NO_ERROR){
+        free_matrix(first);
     }
-
-    return new_mat;
-}
-
-/* Function to find the adjiont of a matrix. */
-Matrix *get_adjoint(const Matrix *matrix){
-    /* If 1x1 matrix, returns the adjoint as 1x1 matrix with the value 1. */
-    if (matrix->rows == 1){
-        Matrix *adj_mat = create_matrix(matrix->rows, matrix->cols);
-        adj_mat->values[0] = 1;
-
-        return adj_mat;
-    }
-
-    /* If bigger than 1x1 matrix, calls functions to find the adjoint. */
-    struct matrix *cofact_mat = find_cofactor(matrix);
-    struct matrix *adj_mat = get_transpose(cofact_mat);
-
-    free_matrix(cofact_mat);
-    return adj_mat;
-}
-
-/* Function to find the inverse of a matrix. */
-Matrix *get_inverse(const Matrix *matrix){
-    /* Checks determinant first to make sure that it is not 0.
-     * Inverse cannot be found if the determinant is 0. */
-    double det = get_determinant(matrix);
-    if (det == 0){
-        fprintf(stderr, "The determinant is 0, so the inverse of the matrix could not be found.\n");
-        exit(INVALID_MATRIX);
-    }
-
-    /* First step is to find adjoint of matrix. */
-    struct matrix *adj_mat = get_adjoint(matrix);
-    Matrix *inv_mat = create_matrix(matrix->rows, matrix->cols);
-
-    /* Divides each value of adjoint matrix by the determinant to find the inverse matrix. */
-    for (int i=0; i<matrix->rows; i++){
-        for (int j=0; j<matrix->cols; j++){
-            inv_mat->values[i*inv_mat->cols+j] = adj_mat->values[i*adj_mat->cols+j]/det;
-        }
-    }
-
-    /* Frees matrix used in process of finding the inverse matrix. */
-    free_matrix(adj_mat);
-    return inv_mat;
+    *matrix2 = check_loaded_matrix(second.error, second.matrix, &second.context);
 }
 
 /* Function to find the last value in an array, used to find the output file from argv. */
@@ -497,20 +287,8 @@ int find_output_file(char *argv[]){
     return (--i);
 }
 
-/* Function to print the matrix elements to the file. */
-void file_print_matrix(FILE *f, const Matrix *matrix){
-    /* States matrix and its rows and columns, as done in input files. */
-    fprintf(f, "matrix %d %d\n", matrix->rows, matrix->cols);
-    for (int i=0; i<matrix->rows; i++){
-        for (int j=0; j<matrix->cols; j++){
-            fprintf(f, "%.12g\t", matrix->values[i*(matrix->cols) + j]);
-        }
-        fprintf(f, "\n");
-    }
-}
-
 /* Function to output the new matrix to a file in the same way as the input file is given. */
-void output_matrix(const int argc, char *argv[], const char operation, Matrix *matrix){
+void output_matrix(const int argc, char *argv[], const char operation, Matrix *matrix, const Options *options){
     /* If no output file given, matrix printed to stdout. */
     FILE *f = stdout;
     char *file_name = "stdout";
@@ -534,25 +312,37 @@ void output_matrix(const int argc, char *argv[], const char operation, Matrix *m
         }
     }
 
-    /* Replicating how the input file is given.
-     * Prints command line arguments in first line of the file as a comment. */
-    fprintf(f, "# ");
-    for (int k=0; k<argc; k++) {
-        fprintf(f, "%s ", argv[k]);
+    if (write_matrix(f, argc, argv, matrix, options->binary_output) != NO_ERROR){
+        exit_malloc_failed();
+    }
+    if (options->binary_output){
+        printf("Output matrix has been written to binary file %s.\n\n", file_name);
+    }
+    else {
+        printf("Output matrix has been printed to file %s.\n\n", file_name);
     }
-    fprintf(f, "\n# Version = %s, Revision date = %s\n", VERSION, REV_DATE);
-    file_print_matrix(f, matrix);
-    fprintf(f, "end\n");
-
-    printf("Output matrix has been printed to file %s.\n\n", file_name);
 
     fclose(f);
 }
 
 /* Function used to store error messages and all functions called when finding the frobenius norm of a matrix. */
-void frobenius_norm(char *argv[]){
+void frobenius_norm(char *argv[], const Options *options){
+    double fn;
+
+    if (options->stream){
+        Context file_context;
+        Error error = stream_frob_norm(argv[INPUT_FILE_1], &fn, &file_context);
+        check_loaded_matrix(error, NULL, &file_context);
+
+        /* Prints the frobenius norm to 10 significant figures. */
+        printf("The frobenius norm of the matrix is %.10g.\n\n", fn);
+        return;
+    }
+
     struct matrix *a = read_matrix(argv[INPUT_FILE_1]);
-    double fn = get_frob_norm(a);
+    if (get_frob_norm(a, &fn) != NO_ERROR){
+        exit_malloc_failed();
+    }
 
     /* Prints the frobenius norm to 10 significant figures. */
     printf("The frobenius norm of the matrix is %.10g.\n\n", fn);
@@ -561,20 +351,55 @@ void frobenius_norm(char *argv[]){
 }
 
 /* Function used to store error messages and all functions called when finding the transpose of a matrix. */
-void transpose(int argc, char *argv[], char operation){
+void transpose(int argc, char *argv[], char operation, const Options *options){
     struct matrix *a = read_matrix(argv[INPUT_FILE_1]);
 
-    struct matrix *c = get_transpose(a);
-    output_matrix(argc, argv, operation, c);
+    /* The matrix is transposed where it is, so peak memory is not doubled for large matrices. */
+    if (transpose_in_place(a) != NO_ERROR){
+        exit_malloc_failed();
+    }
+    output_matrix(argc, argv, operation, a, options);
 
     free_matrix(a);
-    free_matrix(c);
+}
+
+/* Function to check whether a product uses Strassen-Winograd, which is only used when it is chosen in the
+ * options, for square matrices bigger than its cutoff. */
+int uses_strassen(const Matrix *matrix1, const Matrix *matrix2, const Options *options){
+    return options->strassen && matrix1->rows == matrix1->cols && matrix2->rows == matrix2->cols
+           && matrix1->rows == matrix2->rows && matrix1->rows > options->strassen_cutoff;
+}
+
+/* Function to multiply two matrices with the algorithm chosen in the options. When Strassen-Winograd is used,
+ * its error bound is shown next to the classical one. */
+Matrix *multiply(const Matrix *matrix1, const Matrix *matrix2, const Options *options){
+    Matrix *product;
+    Error error;
+
+    if (!uses_strassen(matrix1, matrix2, options)){
+        error = get_product(matrix1, matrix2, &product);
+    }
+    else {
+        double classical_bound, strassen_bound;
+        find_product_error_bounds(matrix1, matrix2, options->strassen_cutoff, &classical_bound, &strassen_bound);
+        printf("Using Strassen-Winograd. Largest possible error in any element is %.3g, compared to %.3g "
+               "for the classical product.\n", strassen_bound, classical_bound);
+
+        error = get_product_strassen(matrix1, matrix2, options->strassen_cutoff, &product);
+    }
+
+    /* The matrices have already been checked, so running out of memory is the only way this can fail. */
+    if (error != NO_ERROR){
+        exit_malloc_failed();
+    }
+
+    return product;
 }
 
 /* Function used to store error messages and all functions called when finding the product of two matrices. */
-void product(int argc, char *argv[], char operation){
-    struct matrix *a = read_matrix(argv[INPUT_FILE_1]);
-    struct matrix *b = read_matrix(argv[INPUT_FILE_2]);
+void product(int argc, char *argv[], char operation, const Options *options){
+    struct matrix *a, *b;
+    read_matrices(argv[INPUT_FILE_1], argv[INPUT_FILE_2], &a, &b);
 
     /* Check that the columns of one matrix match the rows of the other, quits if not. */
     if (a->cols != b->rows && b->cols != a->rows) {
@@ -587,16 +412,16 @@ void product(int argc, char *argv[], char operation){
      * will automatically swap them and fid the product. */
     if (a->cols != b->rows && b->cols == a->rows) {
         printf("\nThe input order of these two matrices was swapped in order to find their product!\n\n.");
-        struct matrix *c = get_product(b, a);
-        output_matrix(argc, argv, operation, c);
+        struct matrix *c = multiply(b, a, options);
+        output_matrix(argc, argv, operation, c, options);
 
         free_matrix(a);
         free_matrix(b);
         free_matrix(c);
     }
     else {
-        struct matrix *c = get_product(a, b);
-        output_matrix(argc, argv, operation, c);
+        struct matrix *c = multiply(a, b, options);
+        output_matrix(argc, argv, operation, c, options);
 
         free_matrix(a);
         free_matrix(b);
@@ -615,7 +440,10 @@ void determinant(char *argv[]){
         exit(INVALID_MATRIX);
     }
 
-    double det = get_determinant(a);
+    double det;
+    if (get_determinant(a, &det) != NO_ERROR){
+        exit_malloc_failed();
+    }
     /* Prints the determinant to 10 significant figures. */
     printf("The determinant of the matrix is %.10g.\n\n", det);
 
@@ -623,7 +451,7 @@ void determinant(char *argv[]){
 }
 
 /* Function used to store error messages and all functions called when finding the adjoint of a matrix. */
-void adjoint(int argc, char *argv[], char operation){
+void adjoint(int argc, char *argv[], char operation, const Options *options){
     struct matrix *a = read_matrix(argv[INPUT_FILE_1]);
 
     /* Checks that the matrix is square. */
@@ -633,15 +461,18 @@ void adjoint(int argc, char *argv[], char operation){
         exit(INVALID_MATRIX);
     }
 
-    struct matrix *c = get_adjoint(a);
-    output_matrix(argc, argv, operation, c);
+    struct matrix *c;
+    if (get_adjoint(a, &c) != NO_ERROR){
+        exit_malloc_failed();
+    }
+    output_matrix(argc, argv, operation, c, options);
 
     free_matrix(a);
     free_matrix(c);
 }
 
 /* Function used to store error messages and all functions called when finding the inverse of a matrix. */
-void inverse(int argc, char *argv[], char operation){
+void inverse(int argc, char *argv[], char operation, const Options *options){
     struct matrix *a = read_matrix(argv[INPUT_FILE_1]);
 
     /* Checks that the matrix is square. */
@@ -651,79 +482,894 @@ void inverse(int argc, char *argv[], char operation){
         exit(INVALID_MATRIX);
     }
 
-    struct matrix *c = get_inverse(a);
+    struct matrix *c;
+    Error error = get_inverse(a, &c);
+    if (error == MEMORY_ERROR){
+        exit_malloc_failed();
+    }
+    if (error != NO_ERROR){
+        fprintf(stderr, "The matrix is singular to working precision, so the inverse could not be found.\n");
+        free_matrix(a);
+        exit(INVALID_MATRIX);
+    }
 
-    output_matrix(argc, argv, operation, c);
+    output_matrix(argc, argv, operation, c, options);
 
     free_matrix(a);
     free_matrix(c);
 }
 
-int main(int argc, char *argv[]) {
+/* Function to check that an operation is known and has the right number of command line arguments. */
+int arguments_valid(const char operation, const int argc){
+    switch (operation){
+        case 'f':
+        case 'd':
+            return argc == NO_ARGS_f_d;
+        case 't':
+        case 'a':
+        case 'i':
+            return argc >= MIN_ARGS_t_a_i && argc <= MAX_ARGS_t_a_i;
+        case 'm':
+            return argc >= MIN_ARGS_m && argc <= MAX_ARGS_m;
+        default:
+            return 0;
+    }
+}
 
-    /* Checks on command line arguments to make sure an operation is given and in the right form.
-     * Any errors and help function is called in order to help user input arguments correctly. */
-    if (argc == 1 || argv[OPERATION_ARGUMENT][0] != '-' || strlen(argv[OPERATION_ARGUMENT]) != OPERATION_INPUT_LENGTH){
-        help(argv);
-        return INCORRECT_ARGUMENTS;
+/* Function to give the error message for a matrix that load_matrix() could not load, without exiting. */
+void print_load_error(const Error error, const Context *context){
+    if (error == FILE_OPEN_ERROR){
+        fprintf(stderr, "Error opening the file %s.\n", context->file_name);
+    }
+    else if (error == MEMORY_ERROR){
+        fprintf(stderr, "Memory could not be allocated for the matrix in %s.\n", context->file_name);
     }
+    else {
+        print_invalid_file(context);
+    }
+}
 
-    char operation = argv[OPERATION_ARGUMENT][1];
+/* Function to record why a job of a batch failed. */
+void fail_job(Job *job, const Error error, const char *message){
+    job->error = error;
+    job->message = message;
+}
 
-    /* Switch statement with operation to call correct function.
-     * If incorrect command line arguments for operation, help() will be called.*/
-    switch (operation){
+/* Function to read the jobs from a batch job file, one for each line that is not blank or a comment. Each
+ * line is an operation and its files, as they would be given on the command line after the program name.
+ * Lines that are not a valid operation are kept as failed jobs, so they are reported in order. */
+Job *read_job_file(char *file_name, char *program_name, int *job_count){
+    FILE *f = fopen(file_name, "r");
+    if (f == NULL){
+        exit_open_failed(file_name);
+    }
+
+    int capacity = 16;
+    Job *jobs = malloc(sizeof(Job) * capacity);
+    if (jobs == NULL){
+        exit_malloc_failed();
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int line_number = 0;
+    *job_count = 0;
+    while (getline(&line, &line_capacity, f) != -1){
+        line_number++;
+        char *token = strtok(line, JOB_SEPARATORS);
+        if (token == NULL || token[0] == '#'){
+            continue;
+        }
+
+        if (*job_count == capacity){
+            capacity *= 2;
+            jobs = realloc(jobs, sizeof(Job) * capacity);
+            if (jobs == NULL){
+                exit_malloc_failed();
+            }
+        }
+        Job *job = &jobs[(*job_count)++];
+        job->line_number = line_number;
+        job->error = NO_ERROR;
+        job->message = NULL;
+        job->inputs[0] = NULL;
+        job->inputs[1] = NULL;
+        job->swapped = 0;
+
+        /* The tokens are split in place, so the job keeps the line, and getline() allocates the next one. */
+        job->text = line;
+        line = NULL;
+        line_capacity = 0;
+        job->argv[0] = program_name;
+        job->argc = 1;
+        while (token != NULL && token[0] != '#'){
+            if (job->argc == MAX_ARGS_m){
+                fail_job(job, INCORRECT_ARGUMENTS, "Incorrect operation or command line arguments.");
+                break;
+            }
+            job->argv[job->argc++] = token;
+            token = strtok(NULL, JOB_SEPARATORS);
+        }
+        job->argv[job->argc] = NULL;
+
+        const char *operation = job->argv[OPERATION_ARGUMENT];
+        job->operation = operation[0] == '-' && strlen(operation) == OPERATION_INPUT_LENGTH ? operation[1] : '\0';
+        if (job->error == NO_ERROR && !arguments_valid(job->operation, job->argc)){
+            fail_job(job, INCORRECT_ARGUMENTS, "Incorrect operation or command line arguments.");
+        }
+        /* Matrices from different jobs cannot be mixed on stdout, so each one needs an output file. */
+        if (job->error == NO_ERROR && job->operation != 'f' && job->operation != 'd'
+            && job->argc != (job->operation == 'm' ? MAX_ARGS_m : MAX_ARGS_t_a_i)){
+            fail_job(job, INCORRECT_ARGUMENTS, "An output file must be given for each job that finds a matrix.");
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return jobs;
+}
+
+/* Function to compare the file names of two inputs, for qsort() and bsearch(). */
+int compare_inputs(const void *a, const void *b){
+    return strcmp(((const LoadTask *) a)->file_name, ((const LoadTask *) b)->file_name);
+}
+
+/* Pool task loading one of the input files of a batch. */
+void load_input(void *arg, int index){
+    LoadTask *inputs = arg;
+    load_matrix_thread(&inputs[index]);
+}
+
+/* Function to find the different input files of the jobs of a batch and load each of them once, between the
+ * threads of the pool. The inputs are sorted by file name, and each job is pointed to the inputs it uses. */
+LoadTask *load_inputs(Job *jobs, const int job_count, int *input_count){
+    LoadTask *inputs = malloc(sizeof(LoadTask) * 2 * (job_count > 0 ? job_count : 1));
+    if (inputs == NULL){
+        exit_malloc_failed();
+    }
+
+    int count = 0;
+    for (int i=0; i<job_count; i++){
+        if (jobs[i].error == NO_ERROR){
+            inputs[count++].file_name = jobs[i].argv[INPUT_FILE_1];
+            if (jobs[i].operation == 'm'){
+                inputs[count++].file_name = jobs[i].argv[INPUT_FILE_2];
+            }
+        }
+    }
+
+    qsort(inputs, (size_t) count, sizeof(LoadTask), compare_inputs);
+    int unique = 0;
+    for (int i=0; i<count; i++){
+        if (unique == 0 || strcmp(inputs[i].file_name, inputs[unique - 1].file_name) != 0){
+            inputs[unique].file_name = inputs[i].file_name;
+            inputs[unique].matrix = NULL;
+            unique++;
+        }
+    }
+
+    run_tasks(load_input, inputs, unique);
+
+    for (int i=0; i<unique; i++){
+        if (inputs[i].error != NO_ERROR){
+            print_load_error(inputs[i].error, &inputs[i].context);
+        }
+    }
+
+    for (int i=0; i<job_count; i++){
+        for (int k=0; k<(jobs[i].operation == 'm' ? 2 : 1) && jobs[i].error == NO_ERROR; k++){
+            LoadTask key;
+            key.file_name = jobs[i].argv[INPUT_FILE_1 + k];
+            jobs[i].inputs[k] = bsearch(&key, inputs, (size_t) unique, sizeof(LoadTask), compare_inputs);
+            if (jobs[i].inputs[k]->error != NO_ERROR){
+                fail_job(&jobs[i], jobs[i].inputs[k]->error, "An input file could not be read.");
+            }
+        }
+    }
+
+    *input_count = unique;
+    return inputs;
+}
+
+/* Pool task running one job of a batch, with its inputs already loaded. The inputs are shared with other
+ * jobs, so they are never changed. Errors are recorded in the job instead of exiting, so the other jobs
+ * still run. */
+void run_job(void *arg, int index){
+    const BatchTask *task = arg;
+    Job *job = &task->jobs[index];
+    if (job->error != NO_ERROR){
+        return;
+    }
+
+    const Matrix *a = job->inputs[0]->matrix;
+    Matrix *result = NULL;
+    Error error = NO_ERROR;
+
+    switch (job->operation){
         case 'f':
-            if (argc != NO_ARGS_f_d){
-                help(argv);
-                return INCORRECT_ARGUMENTS;
+            error = get_frob_norm(a, &job->value);
+            break;
+        case 'd':
+            if (a->rows != a->cols){
+                fail_job(job, INVALID_MATRIX, "This matrix is not square, thus the determinant cannot be found.");
+                return;
             }
-            frobenius_norm(argv);
+            error = get_determinant(a, &job->value);
             break;
         case 't':
-            if (argc < MIN_ARGS_t_a_i || argc > MAX_ARGS_t_a_i){
-                help(argv);
-                return INCORRECT_ARGUMENTS;
+            error = get_transpose(a, &result);
+            break;
+        case 'a':
+            if (a->rows != a->cols){
+                fail_job(job, INVALID_MATRIX, "This matrix is not square, thus the adjoint cannot be found.");
+                return;
             }
-            transpose(argc, argv, operation);
+            error = get_adjoint(a, &result);
             break;
-        case 'm':
-            if (argc < MIN_ARGS_m || argc > MAX_ARGS_m){
-                help(argv);
-                return INCORRECT_ARGUMENTS;
+        case 'i':
+            if (a->rows != a->cols){
+                fail_job(job, INVALID_MATRIX,
+                         "This matrix is not square, thus the inverse of the matrix could not be found.");
+                return;
+            }
+            error = get_inverse(a, &result);
+            if (error == INVALID_MATRIX){
+                fail_job(job, INVALID_MATRIX,
+                         "The matrix is singular to working precision, so the inverse could not be found.");
+                return;
+            }
+            break;
+        case 'm': {
+            const Matrix *b = job->inputs[1]->matrix;
+            if (a->cols != b->rows && b->cols != a->rows){
+                fail_job(job, INVALID_MATRIX, "It is not possible to find the matrix product of these two matrices.");
+                return;
             }
-            product(argc, argv, operation);
+            /* Inputs given the wrong way round are swapped, the same as on the command line. */
+            job->swapped = a->cols != b->rows;
+            const Matrix *left = job->swapped ? b : a;
+            const Matrix *right = job->swapped ? a : b;
+            error = uses_strassen(left, right, task->options)
+                    ? get_product_strassen(left, right, task->options->strassen_cutoff, &result)
+                    : get_product(left, right, &result);
+            break;
+        }
+    }
+    if (error != NO_ERROR){
+        fail_job(job, error, "Memory could not be allocated.");
+        return;
+    }
+    if (result == NULL){
+        return;
+    }
+
+    FILE *f = fopen(job->argv[job->argc - 1], "w+");
+    if (f == NULL){
+        fail_job(job, FILE_OPEN_ERROR, "The output file could not be opened.");
+    }
+    else {
+        error = write_matrix(f, job->argc, job->argv, result, task->options->binary_output);
+        if (error != NO_ERROR){
+            fail_job(job, error, "Memory could not be allocated.");
+        }
+        fclose(f);
+    }
+    free_matrix(result);
+}
+
+/* Function to run every job in a batch job file in one process. Each input file is read once, however many
+ * jobs use it, and all of them are read before any job runs. The jobs are then shared between the threads
+ * of the pool, and their results are printed in the order of the file once they have all finished.
+ * Returns the error of the first job that failed, or NO_ERROR. */
+Error run_batch(char *file_name, char *program_name, const Options *options){
+    int job_count, input_count;
+    Job *jobs = read_job_file(file_name, program_name, &job_count);
+    LoadTask *inputs = load_inputs(jobs, job_count, &input_count);
+
+    BatchTask task = {jobs, options};
+    run_tasks(run_job, &task, job_count);
+
+    Error status = NO_ERROR;
+    for (int i=0; i<job_count; i++){
+        const Job *job = &jobs[i];
+        if (job->error != NO_ERROR){
+            fprintf(stderr, "Line %d of %s: %s\n", job->line_number, file_name, job->message);
+            status = status == NO_ERROR ? job->error : status;
+        }
+        else if (job->operation == 'f'){
+            printf("Line %d: The frobenius norm of the matrix is %.10g.\n", job->line_number, job->value);
+        }
+        else if (job->operation == 'd'){
+            printf("Line %d: The determinant of the matrix is %.10g.\n", job->line_number, job->value);
+        }
+        else {
+            if (job->swapped){
+                printf("Line %d: The input order of these two matrices was swapped in order to find their product.\n",
+                       job->line_number);
+            }
+            printf("Line %d: Output matrix has been written to file %s.\n", job->line_number,
+                   job->argv[job->argc - 1]);
+        }
+    }
+
+    for (int i=0; i<input_count; i++){
+        if (inputs[i].error == NO_ERROR){
+            free_matrix(inputs[i].matrix);
+        }
+    }
+    for (int i=0; i<job_count; i++){
+        free(jobs[i].text);
+    }
+    free(inputs);
+    free(jobs);
+
+    return status;
+}
+
+/* Function to write the whole of a buffer to a file descriptor, returning 0 if it could not be written. */
+int write_fully(const int fd, const void *buffer, size_t length){
+    const char *p = buffer;
+
+    while (length > 0){
+        ssize_t bytes = write(fd, p, length);
+        if (bytes < 0 && errno == EINTR){
+            continue;
+        }
+        if (bytes <= 0){
+            return 0;
+        }
+        p += bytes;
+        length -= (size_t) bytes;
+    }
+
+    return 1;
+}
+
+/* Function to read the whole of a buffer from a file descriptor, returning 0 at the end of the file or if
+ * it could not be read. */
+int read_fully(const int fd, void *buffer, size_t length){
+    char *p = buffer;
+
+    while (length > 0){
+        ssize_t bytes = read(fd, p, length);
+        if (bytes < 0 && errno == EINTR){
+            continue;
+        }
+        if (bytes <= 0){
+            return 0;
+        }
+        p += bytes;
+        length -= (size_t) bytes;
+    }
+
+    return 1;
+}
+
+/* Function to send the header of a reply, which is followed by length bytes of payload. */
+int send_reply_header(const int fd, const Error status, const size_t length){
+    unsigned char header[SERVE_HEADER_SIZE] = {0};
+    write_little_endian(&header[0], 4, (unsigned long long) status);
+    write_little_endian(&header[8], 8, (unsigned long long) length);
+
+    return write_fully(fd, header, SERVE_HEADER_SIZE);
+}
+
+/* Function to send a reply with its payload. */
+int send_reply(const int fd, const Error status, const void *payload, const size_t length){
+    return send_reply_header(fd, status, length) && write_fully(fd, payload, length);
+}
+
+/* Function to send an error reply with a message saying why the request failed. */
+int send_error(const int fd, const Error status, const char *message){
+    return send_reply(fd, status, message, strlen(message));
+}
+
+/* Function to find the resident matrix with a handle, or NULL if there is none. */
+Resident *find_resident(Server *server, const unsigned long long handle){
+    if (handle < 1 || handle > (unsigned long long) server->resident_count
+        || server->residents[handle - 1].matrix == NULL){
+        return NULL;
+    }
+
+    return &server->residents[handle - 1];
+}
+
+/* Function to free a resident matrix and its factorisation, leaving its entry to be used again. */
+void free_resident(Resident *resident){
+    free_matrix(resident->matrix);
+    if (resident->lu != NULL){
+        free_lu(resident->lu);
+    }
+    resident->matrix = NULL;
+    resident->lu = NULL;
+}
+
+/* Function to keep a matrix in the server and send its handle, rows and cols as the reply. */
+int send_new_resident(Server *server, const int fd, Matrix *matrix){
+    int index = 0;
+    while (index < server->resident_count && server->residents[index].matrix != NULL){
+        index++;
+    }
+    if (index == server->resident_count){
+        Resident *larger = realloc(server->residents, sizeof(Resident) * (server->resident_count + 1) * 2);
+        if (larger == NULL){
+            free_matrix(matrix);
+            return send_error(fd, MEMORY_ERROR, "Memory could not be allocated.");
+        }
+        server->residents = larger;
+        for (int i=server->resident_count; i<(server->resident_count + 1) * 2; i++){
+            server->residents[i].matrix = NULL;
+            server->residents[i].lu = NULL;
+        }
+        server->resident_count = (server->resident_count + 1) * 2;
+    }
+    server->residents[index].matrix = matrix;
+
+    unsigned char reply[24];
+    write_little_endian(&reply[0], 8, (unsigned long long) index + 1);
+    write_little_endian(&reply[8], 8, (unsigned long long) matrix->rows);
+    write_little_endian(&reply[16], 8, (unsigned long long) matrix->cols);
+    return send_reply(fd, NO_ERROR, reply, sizeof(reply));
+}
+
+/* Function to find the LU factorisation of a resident matrix the first time it is needed, keeping it in lu. */
+Error factorise_resident(Resident *resident){
+    if (resident->lu != NULL){
+        return NO_ERROR;
+    }
+
+    return factorise_lu(resident->matrix, &resident->lu);
+}
+
+/* Function to serve a request to load a matrix from a file, or from a file sent in the payload. The payload
+ * is owned by the matrix's context from then on. */
+int serve_load(Server *server, const int fd, const unsigned int command, char *payload, const size_t length){
+    Context context;
+    Matrix *matrix = NULL;
+    Error error;
+    char name[] = "The matrix sent";
+
+    if (command == SERVE_LOAD){
+        char *file_name = malloc(length + 1);
+        if (file_name == NULL){
+            free(payload);
+            return send_error(fd, MEMORY_ERROR, "Memory could not be allocated.");
+        }
+        memcpy(file_name, payload, length);
+        file_name[length] = '\0';
+        free(payload);
+
+        error = load_matrix(file_name, &matrix, &context);
+        if (error != NO_ERROR){
+            char message[SERVE_MESSAGE_LENGTH];
+            describe_load_error(message, sizeof(message), error, &context);
+            free(file_name);
+            return send_error(fd, error, message);
+        }
+        free(file_name);
+    }
+    else {
+        error = load_matrix_buffer(name, payload, length, &matrix, &context);
+        if (error != NO_ERROR){
+            char message[SERVE_MESSAGE_LENGTH];
+            describe_load_error(message, sizeof(message), error, &context);
+            return send_error(fd, error, message);
+        }
+    }
+
+    return send_new_resident(server, fd, matrix);
+}
+
+/* Function to serve a request to send a resident matrix back as a binary matrix file. */
+int serve_get(Server *server, const int fd, const unsigned char *payload, const size_t length){
+    Resident *resident = length == 8 ? find_resident(server, read_little_endian(payload, 8)) : NULL;
+    if (resident == NULL){
+        return send_error(fd, INCORRECT_ARGUMENTS, "There is no matrix with this handle.");
+    }
+    const Matrix *matrix = resident->matrix;
+
+    const size_t size = BINARY_HEADER_SIZE + sizeof(double) * matrix->rows * matrix->cols;
+    if (!send_reply_header(fd, NO_ERROR, size)){
+        return 0;
+    }
+
+    /* The file is written through a stream of its own, so closing it does not close the connection. */
+    const int copy = dup(fd);
+    FILE *f = copy >= 0 ? fdopen(copy, "w") : NULL;
+    if (f == NULL){
+        if (copy >= 0){
+            close(copy);
+        }
+        return 0;
+    }
+    /* The header has been sent, so a matrix that cannot be written can only end the connection. */
+    const Error error = write_matrix(f, 0, NULL, matrix, 1);
+    return fclose(f) == 0 && error == NO_ERROR;
+}
+
+/* Function to serve a request to write a resident matrix to a file, as text or binary. */
+int serve_store(Server *server, const int fd, const unsigned char *payload, const size_t length){
+    Resident *resident = length >= 16 ? find_resident(server, read_little_endian(payload, 8)) : NULL;
+    if (resident == NULL){
+        return send_error(fd, INCORRECT_ARGUMENTS, "There is no matrix with this handle.");
+    }
+    const unsigned long long format = read_little_endian(&payload[8], 4);
+    if (format > 1){
+        return send_error(fd, INCORRECT_ARGUMENTS, "The format is not supported.");
+    }
+
+    char *file_name = malloc(length - 16 + 1);
+    if (file_name == NULL){
+        return send_error(fd, MEMORY_ERROR, "Memory could not be allocated.");
+    }
+    memcpy(file_name, &payload[16], length - 16);
+    file_name[length - 16] = '\0';
+
+    FILE *f = fopen(file_name, "w+");
+    free(file_name);
+    if (f == NULL){
+        return send_error(fd, FILE_OPEN_ERROR, "The output file could not be opened.");
+    }
+    const Error error = write_matrix(f, 3, server->comment, resident->matrix, (int) format);
+    fclose(f);
+    if (error != NO_ERROR){
+        return send_error(fd, error, "Memory could not be allocated.");
+    }
+
+    return send_reply(fd, NO_ERROR, NULL, 0);
+}
+
+/* Function to serve a request for an operation on resident matrices. Matrices found are kept in the server,
+ * and the determinant, inverse and adjoint share the factorisation kept with the matrix. */
+int serve_operation(Server *server, const int fd, const unsigned char *payload, const size_t length){
+    if (length != 24){
+        return send_error(fd, INCORRECT_ARGUMENTS, "The request is the wrong length.");
+    }
+    const unsigned long long operation = read_little_endian(payload, 4);
+    Resident *resident = find_resident(server, read_little_endian(&payload[8], 8));
+    Resident *second = find_resident(server, read_little_endian(&payload[16], 8));
+    if (resident == NULL || (operation == 'm' && second == NULL)){
+        return send_error(fd, INCORRECT_ARGUMENTS, "There is no matrix with this handle.");
+    }
+
+    const Matrix *a = resident->matrix;
+    if ((operation == 'd' || operation == 'a' || operation == 'i') && a->rows != a->cols){
+        return send_error(fd, INVALID_MATRIX, "This matrix is not square.");
+    }
+
+    /* The determinant, adjoint and inverse all start from the factorisation. */
+    Error error = NO_ERROR;
+    if (operation == 'd' || operation == 'a' || operation == 'i'){
+        error = factorise_resident(resident);
+    }
+
+    double result = 0;
+    Matrix *c = NULL;
+    switch (operation){
+        case 'f':
+            error = get_frob_norm(a, &result);
             break;
         case 'd':
-            if (argc != NO_ARGS_f_d){
-                help(argv);
-                return INCORRECT_ARGUMENTS;
+            if (error == NO_ERROR){
+                result = lu_determinant(resident->lu);
             }
-            determinant(argv);
+            break;
+        case 't':
+            error = get_transpose(a, &c);
             break;
         case 'a':
-            if (argc < MIN_ARGS_t_a_i || argc > MAX_ARGS_t_a_i){
-                help(argv);
-                return INCORRECT_ARGUMENTS;
+            if (error == NO_ERROR){
+                error = lu_adjoint(a, resident->lu, &c);
             }
-            adjoint(argc, argv, operation);
             break;
         case 'i':
-            if (argc < MIN_ARGS_t_a_i || argc > MAX_ARGS_t_a_i){
-                help(argv);
-                return INCORRECT_ARGUMENTS;
+            if (error == NO_ERROR){
+                error = lu_inverse(resident->lu, &c);
+            }
+            if (error == INVALID_MATRIX){
+                return send_error(fd, INVALID_MATRIX,
+                                  "The matrix is singular to working precision, so the inverse could not be found.");
+            }
+            break;
+        case 'm': {
+            const Matrix *b = second->matrix;
+            if (a->cols != b->rows){
+                return send_error(fd, INVALID_MATRIX, "It is not possible to find the matrix product of these two matrices.");
             }
-            inverse(argc, argv, operation);
+            error = uses_strassen(a, b, server->options) ? get_product_strassen(a, b, server->options->strassen_cutoff, &c)
+                                                         : get_product(a, b, &c);
             break;
+        }
         default:
-            /* If operation not recognised, help is called for user. */
-            help(argv);
-            return INCORRECT_ARGUMENTS;
+            return send_error(fd, INCORRECT_ARGUMENTS, "The operation is not recognised.");
+    }
+
+    if (error != NO_ERROR){
+        return send_error(fd, error, "Memory could not be allocated.");
+    }
+    if (c != NULL){
+        return send_new_resident(server, fd, c);
     }
 
+    unsigned char value[8];
+    unsigned long long bits;
+    memcpy(&bits, &result, sizeof(double));
+    write_little_endian(value, 8, bits);
+    return send_reply(fd, NO_ERROR, value, sizeof(value));
+}
+
+/* Function to serve the requests on one connection until it is closed, returning early if the connection
+ * fails or the server is asked to stop. */
+void serve_connection(Server *server, const int fd){
+    unsigned char header[SERVE_HEADER_SIZE];
+
+    while (!server->stop && read_fully(fd, header, SERVE_HEADER_SIZE)){
+        const unsigned int command = (unsigned int) read_little_endian(header, 4);
+        const unsigned long long length = read_little_endian(&header[8], 8);
+
+        /* A payload that is too big cannot be skipped safely, so the connection is closed after the reply. */
+        if (length > SERVE_MAX_PAYLOAD){
+            send_error(fd, INCORRECT_ARGUMENTS, "The request is too big.");
+            return;
+        }
+        char *payload = malloc((size_t) length + 1);
+        if (payload == NULL){
+            send_error(fd, MEMORY_ERROR, "Memory could not be allocated.");
+            return;
+        }
+        if (!read_fully(fd, payload, (size_t) length)){
+            free(payload);
+            return;
+        }
+
+        int sent;
+        const unsigned char *bytes = (const unsigned char *) payload;
+        Resident *resident;
+        switch (command){
+            case SERVE_LOAD:
+            case SERVE_PUT:
+                /* The payload is given to the load, which frees it. */
+                sent = serve_load(server, fd, command, payload, (size_t) length);
+                payload = NULL;
+                break;
+            case SERVE_GET:
+                sent = serve_get(server, fd, bytes, (size_t) length);
+                break;
+            case SERVE_STORE:
+                sent = serve_store(server, fd, bytes, (size_t) length);
+                break;
+            case SERVE_OPERATION:
+                sent = serve_operation(server, fd, bytes, (size_t) length);
+                break;
+            case SERVE_FREE:
+                resident = length == 8 ? find_resident(server, read_little_endian(bytes, 8)) : NULL;
+                if (resident == NULL){
+                    sent = send_error(fd, INCORRECT_ARGUMENTS, "There is no matrix with this handle.");
+                }
+                else {
+                    free_resident(resident);
+                    sent = send_reply(fd, NO_ERROR, NULL, 0);
+                }
+                break;
+            case SERVE_SHUTDOWN:
+                server->stop = 1;
+                sent = send_reply(fd, NO_ERROR, NULL, 0);
+                break;
+            default:
+                sent = send_error(fd, INCORRECT_ARGUMENTS, "The command is not recognised.");
+        }
+        free(payload);
+
+        if (!sent){
+            return;
+        }
+    }
+}
+
+/* Function to serve requests on a Unix domain socket until a client asks the server to stop. Matrices stay
+ * in memory between requests and connections, so they are only read once, and each keeps the factorisation
+ * found for it. Connections are served one at a time in the order they are made, and each operation uses
+ * every thread of the pool. Returns FILE_OPEN_ERROR if the socket cannot be opened. */
+Error run_server(char *socket_path, char *program_name, const Options *options){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)){
+        fprintf(stderr, "The socket path %s is too long.\n", socket_path);
+        return INCORRECT_ARGUMENTS;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    /* A socket left behind by a server that was killed is replaced, but nothing else is. */
+    struct stat info;
+    if (stat(socket_path, &info) == 0 && S_ISSOCK(info.st_mode)){
+        unlink(socket_path);
+    }
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0
+        || listen(listener, 16) != 0){
+        fprintf(stderr, "Error opening the socket %s.\n", socket_path);
+        if (listener >= 0){
+            close(listener);
+        }
+        return FILE_OPEN_ERROR;
+    }
+
+    /* A client closing its connection early should end that connection, not the server. */
+    signal(SIGPIPE, SIG_IGN);
+    printf("Serving requests on %s.\n", socket_path);
+    fflush(stdout);
+
+    Server server = {NULL, 0, {program_name, "--serve", socket_path}, options, 0};
+    while (!server.stop){
+        const int fd = accept(listener, NULL, NULL);
+        if (fd < 0){
+            if (errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            break;
+        }
+        serve_connection(&server, fd);
+        close(fd);
+    }
+
+    for (int i=0; i<server.resident_count; i++){
+        if (server.residents[i].matrix != NULL){
+            free_resident(&server.residents[i]);
+        }
+    }
+    free(server.residents);
+    close(listener);
+    unlink(socket_path);
+
     return NO_ERROR;
 }
 
+/* Function to read the options starting with '--' from the command line and remove them from argv,
+ * so the operation and files are left in their usual positions. Returns the new argc, or -1 if an
+ * option is not recognised or its value is invalid. */
+int read_options(int argc, char *argv[], Options *options){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    options->threads = cores > 0 ? (int) cores : 1;
+    options->strassen = 0;
+    options->strassen_cutoff = STRASSEN_CUTOFF;
+    options->binary_output = 0;
+    options->stream = 0;
+    options->placement = 0;
+    options->batch_file = NULL;
+    options->socket_path = NULL;
+
+    int kept = 1;
+    for (int i=1; i<argc; i++){
+        if (strncmp(argv[i], "--", 2) != 0){
+            argv[kept++] = argv[i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc){
+            char *end_ptr;
+            long threads = strtol(argv[++i], &end_ptr, 10);
+            if (*end_ptr != '\0' || threads < 1 || threads > 1024){
+                return -1;
+            }
+            options->threads = (int) threads;
+        }
+        else if (strcmp(argv[i], "--strassen") == 0){
+            options->strassen = 1;
+        }
+        else if (strcmp(argv[i], "--strassen-cutoff") == 0 && i+1 < argc){
+            char *end_ptr;
+            long cutoff = strtol(argv[++i], &end_ptr, 10);
+            if (*end_ptr != '\0' || cutoff < 1){
+                return -1;
+            }
+            options->strassen_cutoff = (int) cutoff;
+        }
+        else if (strcmp(argv[i], "--stream") == 0){
+            options->stream = 1;
+        }
+        else if (strcmp(argv[i], "--huge-pages") == 0){
+            options->placement |= PLACE_HUGE_PAGES;
+        }
+        else if (strcmp(argv[i], "--first-touch") == 0){
+            options->placement |= PLACE_FIRST_TOUCH;
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i+1 < argc){
+            options->batch_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i+1 < argc){
+            options->socket_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i+1 < argc){
+            i++;
+            if (strcmp(argv[i], "bin") == 0){
+                options->binary_output = 1;
+            }
+            else if (strcmp(argv[i], "text") == 0){
+                options->binary_output = 0;
+            }
+            else {
+                return -1;
+            }
+        }
+        else {
+            return -1;
+        }
+    }
+    argv[kept] = NULL;
+
+    return kept;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    argc = read_options(argc, argv, &options);
+    /* With --batch or --serve the operations are read from the job file or the socket, so none can be given
+     * on the command line. */
+    const int batch = options.batch_file != NULL;
+    const int serve = options.socket_path != NULL;
+
+    /* Checks on command line arguments to make sure an operation is given and in the right form.
+     * Any errors and help function is called in order to help user input arguments correctly. */
+    if ((batch && serve) || (batch || serve ? argc != 1 : (argc < 2 || argv[OPERATION_ARGUMENT][0] != '-'
+                                                         || strlen(argv[OPERATION_ARGUMENT]) != OPERATION_INPUT_LENGTH))){
+        help(argv);
+        return INCORRECT_ARGUMENTS;
+    }
+
+    char operation = batch || serve ? '\0' : argv[OPERATION_ARGUMENT][1];
+
+    /* If incorrect command line arguments for operation, help() will be called. */
+    if (!batch && !serve && !arguments_valid(operation, argc)){
+        help(argv);
+        return INCORRECT_ARGUMENTS;
+    }
+
+    /* A binary matrix cannot be mixed with the messages printed to stdout, so it needs an output file. */
+    if (options.binary_output && (operation == 't' || operation == 'a' || operation == 'i' || operation == 'm')
+        && argc != (operation == 'm' ? MAX_ARGS_m : MAX_ARGS_t_a_i)){
+        fprintf(stderr, "An output file must be given to write a binary matrix.\n");
+        return INCORRECT_ARGUMENTS;
+    }
+
+    if (start_matrix_calc(options.threads) != NO_ERROR){
+        exit_malloc_failed();
+    }
+    set_matrix_placement(options.placement);
+
+    Error status = NO_ERROR;
+    if (batch){
+        status = run_batch(options.batch_file, argv[0], &options);
+    }
+    if (serve){
+        status = run_server(options.socket_path, argv[0], &options);
+    }
+
+    /* Switch statement with operation to call correct function. */
+    switch (operation){
+        case 'f':
+            frobenius_norm(argv, &options);
+            break;
+        case 't':
+            transpose(argc, argv, operation, &options);
+            break;
+        case 'm':
+            product(argc, argv, operation, &options);
+            break;
+        case 'd':
+            determinant(argv);
+            break;
+        case 'a':
+            adjoint(argc, argv, operation, &options);
+            break;
+        case 'i':
+            inverse(argc, argv, operation, &options);
+            break;
+    }
+
+    stop_matrix_calc();
+    return status;
+}
+
 /*
 
  Here is an example output from the terminal when using mat_calc.c.
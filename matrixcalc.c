@@ -0,0 +1,3580 @@
+/*
+ Title:   Matrix Calculator, library
+ Author:  Jeremy Godden
+*/
+
+/* Packages used throughout the library. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "matrixcalc.h"
+#include "powers_of_five.h"
+
+/* The SIMD kernels are written with x86 intrinsics, and only built where the compiler supports them. */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+ This file, 'matrixcalc.c', is libmatrixcalc, which reads, writes and operates on the matrices for matrix_calc,
+ and for any other program that includes matrixcalc.h. The functions declared there are described where they
+ are defined below, and everything else in it is static. Failures are returned as an Error rather than
+ printed, so the caller decides what to do.
+*/
+
+static const char * VERSION  = "1.0.1";
+static const char * REV_DATE = "30-Oct-2019";
+
+/* Defined variables used within the code. */
+#define MATRIX_ALIGNMENT 64 /* Bytes the rows of allocated matrices are aligned to, a cache line and an AVX-512 vector. */
+#define MATRIX_ALIASING_SIZE 1024 /* Row sizes in bytes that are a multiple of this get a cache line of padding. */
+#define ARENA_BLOCK_SIZE (1 << 20) /* Size of the first block of memory in each thread's arena. */
+#define MATRIX_POOL_CLASSES 8 /* Number of sizes of small matrix kept for reuse, each twice the one before. */
+#define MATRIX_POOL_MIN 8 /* Elements in the smallest pooled size, one cache line. The largest is 1024, up to 32x32. */
+#define MATRIX_POOL_LIMIT 64 /* Most freed matrices of each size kept by a thread for reuse. */
+#define LARGE_MATRIX_SIZE (4 << 20) /* Bytes of values from which a matrix is placed as set_matrix_placement() says. */
+#define HUGE_PAGE_SIZE (2 << 20) /* Size of a transparent huge page, which mapped matrices are aligned to. */
+#define LU_BLOCK_SIZE 64 /* Number of columns factorised together in each LU panel. */
+#define GEMM_MAX_TILE 128 /* Largest number of elements in a tile of C computed by any microkernel. */
+#define GEMM_MC 96 /* Rows of A packed together, sized so the packed block stays in the L2 cache. */
+#define GEMM_KC 256 /* Inner dimension of each packed block, sized so a B panel stays in the L1 cache. */
+#define GEMM_NC 4096 /* Columns of B packed together, sized so the packed block stays in the L3 cache. */
+#define GEMM_TILE_ROWS 192 /* Rows of C in each task of a parallel product, a multiple of every kernel's tile. */
+#define GEMM_TILE_COLS 256 /* Columns of C in each task of a parallel product, a multiple of every kernel's tile. */
+#define GEMM_PARALLEL_MIN 2000000 /* Fewest multiply-adds in a product worth sharing between threads. */
+#define TRANSPOSE_BLOCK_SIZE 32 /* Largest block transposed directly, small enough that both copies fit in the L1 cache. */
+#define SOLVE_BLOCK_SIZE 256 /* Number of right hand side columns solved together with an LU factorisation. */
+#define PARSE_PARALLEL_MIN (1 << 20) /* Fewest bytes of matrix text worth parsing between threads. */
+#define STREAM_RELEASE_SIZE (64 << 20) /* Bytes of a file read while streaming before they are released. */
+#define NORM_BLOCK_SIZE 2048 /* Elements summed by the kernel at a time when finding a frobenius norm. */
+#define NORM_CHUNK_SIZE (1 << 18) /* Elements in each task when a frobenius norm is shared between threads. */
+#define NORM_SQUARE_MIN 0x1p-900 /* Smallest sum of squares added without scaling, far above where squares underflow. */
+#define NORM_SQUARE_MAX 0x1p900 /* Largest sum of squares added without scaling, far below where sums overflow. */
+#define FORMATTED_DOUBLE_LENGTH 32 /* Longest string written for one matrix element by format_double(). */
+#define OUTPUT_BUFFER_SIZE (1 << 20) /* Size of each buffer output matrices are formatted into before being written. */
+
+/* Structure to hold the kernels for the hot loops, chosen at startup for the instruction sets of the CPU. */
+typedef struct kernels{
+    const char *name;
+    /* Adds the product of a packed gemm_mr row A panel and a packed gemm_nr column B panel to a tile of C. */
+    int gemm_mr;
+    int gemm_nr;
+    void (*gemm)(const int kc, const double *a, const double *b, double *c, const int ldc);
+    /* Returns the sum of the squares of count values. */
+    double (*sum_squares)(const double *values, const long count);
+    /* Transposes a transpose_size x transpose_size tile of src into dst. */
+    int transpose_size;
+    void (*transpose)(const double *src, const int src_cols, double *dst, const int dst_cols);
+} Kernels;
+
+/* Structure to hold a pool of worker threads that persist for the life of the program.
+ * Work is given to the pool as a number of tasks, which the workers and the calling thread share out. */
+typedef struct thread_pool{
+    pthread_t *workers;
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_mutex_t submit; /* Held while the pool is running tasks, so only one caller uses it at a time. */
+    pthread_cond_t task_ready;
+    pthread_cond_t task_done;
+    void (*task)(void *arg, int index);
+    void *arg;
+    int task_count;
+    int next_index;
+    int active; /* Workers that have not yet finished with the current tasks. */
+    long generation; /* Increased each time new tasks are given to the pool. */
+    int stop;
+} ThreadPool;
+
+/* Structure at the start of the single block of memory an allocated matrix is kept in. Its values follow it,
+ * from the next MATRIX_ALIGNMENT boundary. Small blocks are pooled by size class when they are freed. */
+typedef struct matrix_block{
+    Matrix matrix;
+    struct matrix_block *next; /* Next free block of the same size class, while it is in a thread's pool. */
+    int size_class; /* -1 if the block is too large to be pooled. */
+    size_t mapped_size; /* Bytes mapped for the block with mmap(), or 0 if it was allocated with malloc(). */
+    int zeroed; /* Whether the values were set to 0 when the block was allocated. */
+} MatrixBlock;
+
+/* Structure for a block of memory in a thread's arena. Scratch buffers are taken from the free end of the
+ * newest block in turn, and given back all at once by going back to a mark. */
+typedef struct arena_block{
+    struct arena_block *previous;
+    char *data; /* Start of the memory for buffers, aligned to MATRIX_ALIGNMENT. */
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+/* Structure for a position in a thread's arena. Every buffer taken after it is given back by arena_release(). */
+typedef struct arena_mark{
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+/* Structure to hold the arguments of a matrix product split into tiles of C for a thread pool. */
+typedef struct gemm_task{
+    double alpha;
+    MatrixView a, b, c;
+    int tile_rows, tile_cols, col_tiles;
+} GemmTask;
+
+/* Structure to hold the arguments of zeroing a new matrix in the tiles a product would split it into. */
+typedef struct touch_task{
+    Matrix *matrix;
+    int tile_rows, tile_cols, col_tiles;
+} TouchTask;
+
+/* Structure to hold the position while reading a file, and the context its errors are recorded in. The file
+ * is held in memory, and tokens point into it, so they are not terminated with a '\0'. */
+typedef struct reader{
+    Context *context;
+    const char *data;
+    size_t size;
+    int mapped; /* Whether data is a memory mapping of the file, rather than an allocated copy. */
+    const char *next_line;
+    const char *line_end;
+    const char *cursor;
+    const char *token; /* NULL at the end of a line. */
+    int token_length;
+    int line_number;
+} Reader;
+
+/* Structure for a chunk of whole lines of a text matrix file, parsed by one task. */
+typedef struct parse_chunk{
+    const char *start;
+    const char *end;
+    int rows; /* Number of lines holding data, rather than being blank or comments. */
+    int first_row; /* Index of the row on the first data line. */
+    int failed;
+    int end_found;
+} ParseChunk;
+
+/* Structure for parsing the rows of a text matrix file between the threads of the pool. */
+typedef struct parse_task{
+    Matrix *matrix;
+    const Reader *reader;
+    ParseChunk *chunks;
+} ParseTask;
+
+/* Structure for a sum of squares, sum * 2^(2*exponent), as in dnrm2. Keeping the exponent apart means the sum
+ * cannot overflow or underflow, and compensation holds the rounding errors of adding to it. */
+typedef struct sum_squares{
+    double sum;
+    double compensation;
+    int exponent;
+} SumSquares;
+
+/* Structure for finding the sum of squares of the elements of a matrix between the threads of the pool, a chunk
+ * of count elements for each task. The elements are in rows of cols elements, stride apart. */
+typedef struct norm_task{
+    const double *values;
+    long count;
+    long cols;
+    long stride;
+    SumSquares *sums;
+} NormTask;
+
+/* Structure to hold the LU factorisation of a square matrix, found with partial or complete pivoting.
+ * L is stored below the diagonal of factors (its unit diagonal is not stored) and U on and above it. */
+typedef struct lu{
+    Matrix *factors;
+    int *pivots; /* Row swapped with row i at step i. */
+    int *col_pivots; /* Column swapped with column i at step i, or NULL if only rows were pivoted. */
+    int sign; /* Sign of the row permutation, used for the determinant. */
+    double *row_scales; /* Scale of each row of the equilibrated matrix R*A*C, so its largest element is 1. */
+    double *col_scales; /* Scale of each column of R*A*C, found after the rows are scaled. */
+    double scaled_norm; /* 1-norm of R*A*C, used with the inverse to judge whether A is singular. */
+} LU;
+
+/* Structure for a number f * 2^e with a 64 bit significand, used when formatting doubles. */
+typedef struct diy_fp{
+    unsigned long long f;
+    int e;
+} DiyFp;
+
+/* Structure for writing a matrix as text between the threads of the pool, a block of rows for each task. */
+typedef struct format_task{
+    const Matrix *matrix;
+    int first_row;
+    int block_rows;
+    size_t buffer_size;
+    char *buffers;
+    size_t *lengths;
+} FormatTask;
+
+/* Function to map a whole file into memory for reading, setting the data and size in the reader.
+ * Files that cannot be mapped, such as pipes, are read into an allocated buffer instead. The mapping is
+ * private and writable, so a binary matrix can be used and changed in place without changing the file. */
+static Error map_file(const char *file_name, Reader *reader){
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0){
+        return FILE_OPEN_ERROR;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+        void *data = mmap(NULL, (size_t) info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED){
+            /* The file is scanned once from start to end, so the kernel can read ahead aggressively. */
+            madvise(data, (size_t) info.st_size, MADV_SEQUENTIAL);
+            reader->data = data;
+            reader->size = (size_t) info.st_size;
+            reader->mapped = 1;
+            close(fd);
+            return NO_ERROR;
+        }
+    }
+
+    size_t capacity = 1 << 16;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL){
+        close(fd);
+        return MEMORY_ERROR;
+    }
+    reader->size = 0;
+
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer + reader->size, capacity - reader->size)) > 0){
+        reader->size += (size_t) bytes;
+        if (reader->size == capacity){
+            capacity *= 2;
+            char *larger = realloc(buffer, capacity);
+            if (larger == NULL){
+                free(buffer);
+                close(fd);
+                return MEMORY_ERROR;
+            }
+            buffer = larger;
+        }
+    }
+
+    reader->data = buffer;
+    reader->mapped = 0;
+    close(fd);
+    return NO_ERROR;
+}
+
+/* Function to release the memory holding a file after it has been read. */
+static void unmap_file(Reader *reader){
+    if (reader->mapped){
+        munmap((void *) reader->data, reader->size);
+    }
+    else {
+        free((void *) reader->data);
+    }
+}
+
+/* Function to record why the file being read is invalid, returning INVALID_FILE. The current token is
+ * copied, so it can still be shown in the error message after the file has been released. */
+static Error invalid_file(Reader *reader, const char *message){
+    reader->context->message = message;
+    reader->context->line_number = reader->line_number;
+    reader->context->invalid_token_length = -1;
+    if (reader->token != NULL){
+        reader->context->invalid_token_length = reader->token_length < INVALID_TOKEN_LENGTH ? reader->token_length
+                                                                                    : INVALID_TOKEN_LENGTH;
+        memcpy(reader->context->invalid_token, reader->token, (size_t) reader->context->invalid_token_length);
+    }
+
+    return INVALID_FILE;
+}
+
+/* Function to find the stride of an allocated matrix with cols columns. Rows are padded to a whole number of
+ * cache lines, so each starts aligned for vector loads. If that makes a row a multiple of MATRIX_ALIASING_SIZE
+ * bytes, the elements of a column all fall in a few cache sets and evict each other, and loads alias with
+ * earlier stores 4K apart, so one more cache line is added. Matrices narrower than a cache line are not padded,
+ * as that would more than double their size. */
+static int matrix_stride(const int cols){
+    const int line = MATRIX_ALIGNMENT / (int) sizeof(double);
+    if (cols < line){
+        return cols;
+    }
+
+    int stride = (cols + line - 1) / line * line;
+    if ((stride * sizeof(double)) % MATRIX_ALIASING_SIZE == 0){
+        stride += line;
+    }
+    return stride;
+}
+
+/* Function to find the first address at or after pointer that is a multiple of MATRIX_ALIGNMENT. */
+static void *align_pointer(void *pointer){
+    const uintptr_t address = (uintptr_t) pointer;
+    return (void *) (address + (MATRIX_ALIGNMENT - address % MATRIX_ALIGNMENT) % MATRIX_ALIGNMENT);
+}
+
+/* Freed blocks of the calling thread's small matrices for each size class, and how many there are of each. */
+static __thread MatrixBlock *matrix_pool[MATRIX_POOL_CLASSES];
+static __thread int matrix_pool_count[MATRIX_POOL_CLASSES];
+
+/* How the values of large matrices are placed in memory, any of the PLACE_ flags, set by set_matrix_placement(). */
+static int placement = 0;
+
+/* Key whose destructor frees a thread's arena and pooled matrices when the thread ends, created by
+ * start_matrix_calc(). Any value but NULL makes the destructor run, so it is set once the thread has either. */
+static pthread_key_t thread_memory_key;
+
+/* Function to view the whole of a matrix. */
+MatrixView view_matrix(const Matrix *matrix){
+    MatrixView view = {matrix->values, matrix->rows, matrix->cols, matrix->stride, -1, -1};
+    return view;
+}
+
+/* Function to find the row of the viewed block that row i of a view is, stepping over any row left out. */
+static int view_row_index(const MatrixView *view, const int i){
+    return view->skip_row >= 0 && i >= view->skip_row ? i + 1 : i;
+}
+
+/* Function to find the column of the viewed block that column j of a view is, stepping over any column left out. */
+static int view_col_index(const MatrixView *view, const int j){
+    return view->skip_col >= 0 && j >= view->skip_col ? j + 1 : j;
+}
+
+/* Function to count the columns of a view from column j on that are next to each other in the viewed block,
+ * up to the column left out or the end of the row, so they can be read or written as a run. */
+static int view_run(const MatrixView *view, const int j){
+    return view->skip_col > j ? view->skip_col - j : view->cols - j;
+}
+
+/* Function to find the start of row i of a view in the viewed block, which column j is view_col_index() along. */
+static double *view_row(const MatrixView *view, const int i){
+    return &view->values[(size_t) view_row_index(view, i) * view->stride];
+}
+
+/* Function to find element (row, col) of a view. */
+double *view_element(const MatrixView *view, const int row, const int col){
+    return &view_row(view, row)[view_col_index(view, col)];
+}
+
+/* Function to view the rows x cols block of a view starting at (row, col). The block leaves out the same row
+ * and column as the view, if they fall inside it. */
+MatrixView view_block(const MatrixView *view, const int row, const int col, const int rows, const int cols){
+    const int first_row = view_row_index(view, row), last_row = view_row_index(view, row + rows - 1);
+    const int first_col = view_col_index(view, col), last_col = view_col_index(view, col + cols - 1);
+
+    MatrixView block = {&view->values[(size_t) first_row*view->stride + first_col], rows, cols, view->stride,
+                        view->skip_row > first_row && view->skip_row < last_row ? view->skip_row - first_row : -1,
+                        view->skip_col > first_col && view->skip_col < last_col ? view->skip_col - first_col : -1};
+    return block;
+}
+
+/* Function to view the minor of a view found by leaving out one row and one column. */
+MatrixView view_minor(const MatrixView *view, const int row, const int col){
+    MatrixView minor = {view->values, view->rows - 1, view->cols - 1, view->stride, row, col};
+    return minor;
+}
+
+/* Pool of worker threads shared by the parallel kernels, created by start_matrix_calc(). */
+static ThreadPool *pool = NULL;
+
+/* Set in threads while they run a pool task, so nested parallel work runs serially instead of deadlocking. */
+static __thread int in_pool_task = 0;
+
+/* Function run by each worker thread. Workers sleep until new tasks are given to the pool, take task
+ * indices until none are left, then report that they have finished and go back to sleep. */
+static void *pool_worker(void *data){
+    ThreadPool *pool = data;
+    long seen_generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1){
+        while (!pool->stop && pool->generation == seen_generation){
+            pthread_cond_wait(&pool->task_ready, &pool->lock);
+        }
+        if (pool->stop){
+            break;
+        }
+        seen_generation = pool->generation;
+
+        while (pool->next_index < pool->task_count){
+            int index = pool->next_index++;
+            pthread_mutex_unlock(&pool->lock);
+
+            in_pool_task = 1;
+            pool->task(pool->arg, index);
+            in_pool_task = 0;
+
+            pthread_mutex_lock(&pool->lock);
+        }
+
+        pool->active--;
+        if (pool->active == 0){
+            pthread_cond_signal(&pool->task_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* Function to create a pool with thread_count threads in total, counting the thread that gives it work.
+ * Returns NULL if there is not enough memory. */
+static ThreadPool *create_thread_pool(const int thread_count){
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+    if (pool == NULL){
+        return NULL;
+    }
+
+    pool->worker_count = thread_count - 1;
+    pool->workers = malloc(sizeof(pthread_t) * (pool->worker_count > 0 ? pool->worker_count : 1));
+    if (pool->workers == NULL){
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->submit, NULL);
+    pthread_cond_init(&pool->task_ready, NULL);
+    pthread_cond_init(&pool->task_done, NULL);
+    pool->task_count = 0;
+    pool->next_index = 0;
+    pool->active = 0;
+    pool->generation = 0;
+    pool->stop = 0;
+
+    for (int i=0; i<pool->worker_count; i++){
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0){
+            /* Runs with the workers that did start, or serially if none did. */
+            pool->worker_count = i;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+/* Function to stop the worker threads and free the pool. */
+static void free_thread_pool(ThreadPool *pool){
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->task_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i=0; i<pool->worker_count; i++){
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->submit);
+    pthread_cond_destroy(&pool->task_ready);
+    pthread_cond_destroy(&pool->task_done);
+    free(pool->workers);
+    free(pool);
+}
+
+/* Function to run task(arg, index) for every index in [0, task_count), shared between the pool's workers
+ * and the calling thread, returning once every task has finished. If there is no pool, it is already busy,
+ * or this is called from inside a pool task, the tasks are run serially by the calling thread. */
+static void run_parallel(ThreadPool *pool, void (*task)(void *arg, int index), void *arg, const int task_count){
+    if (pool == NULL || pool->worker_count == 0 || task_count < 2 || in_pool_task
+        || pthread_mutex_trylock(&pool->submit) != 0){
+        for (int i=0; i<task_count; i++){
+            task(arg, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->task_count = task_count;
+    pool->next_index = 0;
+    pool->active = pool->worker_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->task_ready);
+
+    /* The calling thread takes tasks too, rather than waiting idle. */
+    while (pool->next_index < pool->task_count){
+        int index = pool->next_index++;
+        pthread_mutex_unlock(&pool->lock);
+
+        in_pool_task = 1;
+        task(arg, index);
+        in_pool_task = 0;
+
+        pthread_mutex_lock(&pool->lock);
+    }
+
+    while (pool->active > 0){
+        pthread_cond_wait(&pool->task_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->submit);
+}
+
+/* Function to run task(arg, index) for every index in [0, task_count) on the library's pool, so callers can
+ * share their own work between the same threads. */
+void run_tasks(void (*task)(void *arg, int index), void *arg, const int task_count){
+    run_parallel(pool, task, arg, task_count);
+}
+
+/* Newest block of the calling thread's arena, which the operations take their scratch buffers from. */
+static __thread ArenaBlock *arena = NULL;
+
+/* Function to free every block of the calling thread's arena. */
+static void free_arena(void){
+    while (arena != NULL){
+        ArenaBlock *previous = arena->previous;
+        free(arena);
+        arena = previous;
+    }
+}
+
+/* Function to add a block of size bytes to the calling thread's arena, returning 0 if there is not enough memory. */
+static int grow_arena(const size_t size){
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size + MATRIX_ALIGNMENT);
+    if (block == NULL){
+        return 0;
+    }
+
+    block->previous = arena;
+    block->data = align_pointer(block + 1);
+    block->size = size;
+    block->used = 0;
+    if (arena == NULL){
+        pthread_setspecific(thread_memory_key, block);
+    }
+    arena = block;
+    return 1;
+}
+
+/* Function to find the current position of the calling thread's arena, to give back what is taken after it. */
+static ArenaMark arena_mark(void){
+    ArenaMark mark = {arena, arena != NULL ? arena->used : 0};
+    return mark;
+}
+
+/* Function to take a buffer of size bytes from the calling thread's arena, aligned to MATRIX_ALIGNMENT. If the
+ * newest block is full, a block twice its size is added, so the arena soon stops growing. Returns NULL if there
+ * is not enough memory. The buffer is given back by arena_release(), not free(). */
+static void *arena_alloc(const size_t size){
+    const size_t rounded = (size + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+
+    if (arena == NULL || arena->size - arena->used < rounded){
+        const size_t block_size = arena != NULL ? 2 * arena->size : ARENA_BLOCK_SIZE;
+        if (!grow_arena(block_size > rounded ? block_size : rounded)){
+            return NULL;
+        }
+    }
+
+    void *buffer = arena->data + arena->used;
+    arena->used += rounded;
+    return buffer;
+}
+
+/* Function to give back every buffer taken from the calling thread's arena since the mark, which only moves the
+ * end of the newest block back. Blocks added since the mark are freed, and if that empties the arena, it is
+ * replaced by one block as big as all of them, so the next operation as large does not need to grow it. */
+static void arena_release(const ArenaMark mark){
+    size_t freed = 0;
+    while (arena != mark.block){
+        ArenaBlock *previous = arena->previous;
+        freed += arena->size;
+        free(arena);
+        arena = previous;
+    }
+    if (arena != NULL){
+        arena->used = mark.used;
+    }
+
+    if (freed > 0 && (arena == NULL || (arena->previous == NULL && arena->used == 0))){
+        if (arena != NULL){
+            freed += arena->size;
+            free(arena);
+            arena = NULL;
+        }
+        grow_arena(freed);
+    }
+}
+
+/* Function to find the size class of a matrix block with room for count elements, or -1 if it is too large to
+ * be pooled. Class c holds MATRIX_POOL_MIN << c elements. */
+static int matrix_size_class(const size_t count){
+    int size_class = 0;
+    size_t capacity = MATRIX_POOL_MIN;
+    while (capacity < count){
+        capacity *= 2;
+        size_class++;
+    }
+    return size_class < MATRIX_POOL_CLASSES ? size_class : -1;
+}
+
+/* Function to free every block in the calling thread's pool of small matrices. */
+static void free_matrix_pool(void){
+    for (int size_class=0; size_class<MATRIX_POOL_CLASSES; size_class++){
+        while (matrix_pool[size_class] != NULL){
+            MatrixBlock *next = matrix_pool[size_class]->next;
+            free(matrix_pool[size_class]);
+            matrix_pool[size_class] = next;
+        }
+        matrix_pool_count[size_class] = 0;
+    }
+}
+
+/* Destructor of thread_memory_key, freeing the arena and pooled matrices of a thread as it ends. */
+static void free_thread_memory(void *value){
+    (void) value;
+    free_arena();
+    free_matrix_pool();
+}
+
+/* Function to choose the tiles of C that a product with an m x n result is split into for the pool. Tiles are
+ * made smaller until there are a few for each thread, so the threads finish together. */
+static void choose_gemm_tiles(const int m, const int n, const int threads, int *tile_rows, int *tile_cols){
+    *tile_rows = GEMM_TILE_ROWS;
+    *tile_cols = GEMM_TILE_COLS;
+    while ((long) ((m + *tile_rows - 1) / *tile_rows) * ((n + *tile_cols - 1) / *tile_cols) < 4L * threads
+           && (*tile_rows > GEMM_TILE_ROWS / 4 || *tile_cols > GEMM_TILE_COLS / 4)){
+        if (*tile_rows >= *tile_cols && *tile_rows > GEMM_TILE_ROWS / 4){
+            *tile_rows /= 2;
+        }
+        else {
+            *tile_cols /= 2;
+        }
+    }
+}
+
+/* Pool task zeroing one tile of a new matrix, so the thread that runs it is the first to touch its pages. */
+static void touch_tile(void *arg, int index){
+    const TouchTask *t = arg;
+    const Matrix *matrix = t->matrix;
+    const int i = (index / t->col_tiles) * t->tile_rows;
+    const int j = (index % t->col_tiles) * t->tile_cols;
+    const int rows = matrix->rows - i < t->tile_rows ? matrix->rows - i : t->tile_rows;
+    const int cols = matrix->cols - j < t->tile_cols ? matrix->cols - j : t->tile_cols;
+
+    for (int r=i; r<i+rows; r++){
+        memset(&matrix->values[(size_t) r*matrix->stride + j], 0, sizeof(double) * cols);
+    }
+}
+
+/* Function to zero a large new matrix on the threads of the pool, in the tiles a product with it as the result
+ * is shared out in, so the kernel places each page on the memory node of the thread that touches it first. The
+ * pool hands tiles to whichever thread is free, so a page is only likely, not certain, to be placed next to the
+ * thread that later computes its tile. Returns 0 if the matrix is left as it is, as there is only one thread. */
+static int first_touch(Matrix *matrix){
+    const int threads = pool == NULL ? 1 : pool->worker_count + 1;
+    if (threads == 1){
+        return 0;
+    }
+
+    TouchTask task = {matrix, 0, 0, 0};
+    choose_gemm_tiles(matrix->rows, matrix->cols, threads, &task.tile_rows, &task.tile_cols);
+    const int row_tiles = (matrix->rows + task.tile_rows - 1) / task.tile_rows;
+    task.col_tiles = (matrix->cols + task.tile_cols - 1) / task.tile_cols;
+    run_parallel(pool, touch_tile, &task, row_tiles * task.col_tiles);
+    return 1;
+}
+
+/* Function to map a block of at least size bytes for a large matrix, starting on a huge page boundary and
+ * advised to use transparent huge pages, so that a product touching all of it needs far fewer TLB entries.
+ * Returns NULL if it cannot be mapped. */
+static MatrixBlock *map_huge_block(const size_t size){
+    const size_t mapped_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+
+    /* One huge page more is mapped than is needed, and the ends either side of the aligned block are unmapped. */
+    char *mapping = mmap(NULL, mapped_size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+    if (mapping == MAP_FAILED){
+        return NULL;
+    }
+    const size_t head = (HUGE_PAGE_SIZE - (uintptr_t) mapping % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+    if (head > 0){
+        munmap(mapping, head);
+    }
+    munmap(mapping + head + mapped_size, HUGE_PAGE_SIZE - head);
+
+    MatrixBlock *block = (MatrixBlock *) (mapping + head);
+#ifdef MADV_HUGEPAGE
+    madvise(block, mapped_size, MADV_HUGEPAGE);
+#endif
+    block->mapped_size = mapped_size;
+    return block;
+}
+
+/* Function to allocate memory for a structure storing a matrix, returning NULL if there is not enough. The
+ * structure and values are one block, so they are allocated and freed together and sit next to each other.
+ * Blocks for small matrices are taken from the calling thread's pool when it has one of the right size, and
+ * large ones are placed as set_matrix_placement() says. */
+Matrix *allocate_matrix(const int rows, const int cols){
+    const int stride = matrix_stride(cols);
+    const size_t count = (size_t) rows * stride;
+    const int size_class = matrix_size_class(count);
+    const int large = sizeof(double) * count >= LARGE_MATRIX_SIZE;
+
+    MatrixBlock *block = NULL;
+    if (size_class >= 0 && matrix_pool[size_class] != NULL){
+        block = matrix_pool[size_class];
+        matrix_pool[size_class] = block->next;
+        matrix_pool_count[size_class]--;
+        block->zeroed = 0;
+    }
+    else {
+        /* Allocates room to move the start of the values to an aligned address. posix_memalign() is not used,
+         * as glibc maps each large aligned block afresh instead of reusing freed memory, so every new matrix
+         * would fault its pages in again. Huge pages are worth that cost, and are mapped on their own. */
+        const size_t capacity = size_class >= 0 ? (size_t) MATRIX_POOL_MIN << size_class : count;
+        const size_t size = sizeof(MatrixBlock) + MATRIX_ALIGNMENT + sizeof(double) * capacity;
+        if (large && (placement & PLACE_HUGE_PAGES)){
+            block = map_huge_block(size);
+        }
+        if (block != NULL){
+            block->zeroed = 1;
+        }
+        else {
+            block = malloc(size);
+            if (block == NULL) {
+                return NULL;
+            }
+            block->mapped_size = 0;
+            block->zeroed = 0;
+        }
+        block->size_class = size_class;
+    }
+
+    Matrix *matrix = &block->matrix;
+    matrix->rows = rows;
+    matrix->cols = cols;
+    matrix->stride = stride;
+    matrix->values = align_pointer(block + 1);
+    matrix->mapping = NULL;
+    matrix->mapping_size = 0;
+
+    if (large && (placement & PLACE_FIRST_TOUCH) && first_touch(matrix)){
+        block->zeroed = 1;
+    }
+
+    return matrix;
+}
+
+/* Function to allocate a matrix with every element 0, returning NULL if there is not enough memory. Matrices
+ * that were zeroed as they were placed are not zeroed again. */
+static Matrix *allocate_zero_matrix(const int rows, const int cols){
+    Matrix *matrix = allocate_matrix(rows, cols);
+    if (matrix != NULL && !((MatrixBlock *) matrix)->zeroed){
+        memset(matrix->values, 0, sizeof(double) * rows * matrix->stride);
+    }
+    return matrix;
+}
+
+/* Function to free the memory used to store a matrix in a Matrix structure. A small matrix's block is kept in
+ * the calling thread's pool for reuse, unless the pool already holds enough of its size. */
+void free_matrix(Matrix *matrix){
+    if (matrix->mapping != NULL){
+        munmap(matrix->mapping, matrix->mapping_size);
+        free(matrix);
+        return;
+    }
+
+    MatrixBlock *block = (MatrixBlock *) matrix;
+    if (block->mapped_size > 0){
+        munmap(block, block->mapped_size);
+        return;
+    }
+
+    const int size_class = block->size_class;
+    if (size_class < 0 || matrix_pool_count[size_class] >= MATRIX_POOL_LIMIT){
+        free(block);
+        return;
+    }
+
+    if (matrix_pool_count[size_class] == 0){
+        pthread_setspecific(thread_memory_key, block);
+    }
+    block->next = matrix_pool[size_class];
+    matrix_pool[size_class] = block;
+    matrix_pool_count[size_class]++;
+}
+
+/* Function to check whether a character separates tokens, being a space, tab, carriage return or newline. */
+static int is_separator(const char c){
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Function to find the next token in the current line, starting from the cursor. Sets the token as the
+ * error context token, or sets it to NULL if the end of the line is reached. */
+static const char *scan_token(Reader *reader){
+    const char *p = reader->cursor;
+
+    while (p < reader->line_end && is_separator(*p)){
+        p++;
+    }
+    if (p == reader->line_end){
+        reader->cursor = p;
+        reader->token = NULL;
+        reader->token_length = 0;
+        return NULL;
+    }
+
+    const char *start = p;
+    while (p < reader->line_end && !is_separator(*p)){
+        p++;
+    }
+
+    reader->cursor = p;
+    reader->token = start;
+    reader->token_length = (int) (p - start);
+    return start;
+}
+
+/* Function to read a line of a file, skipping any that are blank or start with a #. Sets the first token
+ * of the line as the token used in the error context message. */
+static Error read_line(Reader *reader){
+    const char *end = reader->data + reader->size;
+
+    do {
+        /* Moves the cursor to the start of the next line, or fails at the end of the file. */
+        const char *start = reader->next_line;
+        reader->line_number++;
+        if (start >= end){
+            return invalid_file(reader, "");
+        }
+
+        const char *newline = memchr(start, '\n', (size_t) (end - start));
+        reader->line_end = newline != NULL ? newline : end;
+        reader->next_line = newline != NULL ? newline + 1 : end;
+        reader->cursor = start;
+
+        scan_token(reader);
+    } while (reader->token == NULL || reader->token[0] == '#');
+
+    return NO_ERROR;
+}
+
+/* Function to get the next token in a line of separated strings. */
+static const char *get_new_token(Reader *reader){
+    return scan_token(reader);
+}
+
+/* Function to check whether the current token is the given word. */
+static int token_is(const Reader *reader, const char *word){
+    return reader->token != NULL && (size_t) reader->token_length == strlen(word)
+           && memcmp(reader->token, word, (size_t) reader->token_length) == 0;
+}
+
+/* Function to check whether the current token ends the useful part of a line, being the end or a comment. */
+static int token_ends_line(const Reader *reader){
+    return reader->token == NULL || reader->token[0] == '#';
+}
+
+/* Function to turn the current token into an int no bigger than maximum, usually to find the rows and
+ * cols of a matrix. */
+static Error get_int(Reader *reader, const int maximum, int *value){
+    /* The token is not terminated in the file, so it is copied first. Longer tokens cannot be valid. */
+    char token[32];
+    if (reader->token == NULL || reader->token_length >= (int) sizeof(token)){
+        return invalid_file(reader, "Stated rows or columns are invalid.");
+    }
+    memcpy(token, reader->token, (size_t) reader->token_length);
+    token[reader->token_length] = '\0';
+
+    char *end_ptr;
+    /* Use strtol to change a string to a long. */
+    long number = strtol(token, &end_ptr, 10);
+
+    /* Checks that there are no more characters after the value, using the end_ptr.
+     * And that the value is valid. */
+    if (*end_ptr != '\0' || number < 1){
+        return invalid_file(reader, "Stated rows or columns are invalid.");
+    }
+    if (number > maximum){
+        return invalid_file(reader, "Rows or columns of the matrix are bigger than the maximum value allowed.");
+    }
+
+    /* Sets the value as an int. */
+    *value = (int) number;
+    return NO_ERROR;
+}
+
+/* Function to multiply two 64 bit numbers into a 128 bit result, split into high and low halves. */
+static void multiply_64(const unsigned long long a, const unsigned long long b, unsigned long long *high,
+                 unsigned long long *low){
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = (unsigned __int128) a * b;
+    *high = (unsigned long long) (product >> 64);
+    *low = (unsigned long long) product;
+#else
+    const unsigned long long a_lo = a & 0xFFFFFFFFULL, a_hi = a >> 32;
+    const unsigned long long b_lo = b & 0xFFFFFFFFULL, b_hi = b >> 32;
+    const unsigned long long lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo, lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+    const unsigned long long middle = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFFULL) + lo_hi;
+    *high = hi_hi + (hi_lo >> 32) + (middle >> 32);
+    *low = (middle << 32) | (lo_lo & 0xFFFFFFFFULL);
+#endif
+}
+
+/* Function to count the leading zero bits of a non-zero 64 bit number. */
+static int leading_zeros(unsigned long long x){
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(x);
+#else
+    int count = 0;
+    while (!(x & (1ULL << 63))){
+        x <<= 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+/* Function to find the double nearest to w * 10^q with the Eisel-Lemire algorithm, where w is non-zero.
+ * w is multiplied by a 128 bit approximation of 5^q, which gives the result exactly unless it is too
+ * close to halfway between two doubles, or is subnormal or infinite. Returns 0 in those cases. */
+static int eisel_lemire(const unsigned long long w, const int q, const int negative, double *value){
+    if (q < POWER_OF_FIVE_MIN || q > POWER_OF_FIVE_MAX){
+        return 0;
+    }
+
+    const int lz = leading_zeros(w);
+    const unsigned long long normalised = w << lz;
+    const unsigned long long *power = POWERS_OF_FIVE[q - POWER_OF_FIVE_MIN];
+
+    /* The top 55 bits of the product are needed. If the bits below them are all ones, a carry from the
+     * lower half of the power could change them, so the second half is multiplied in as well. */
+    unsigned long long high, low;
+    multiply_64(normalised, power[0], &high, &low);
+    if ((high & 0x1FF) == 0x1FF){
+        unsigned long long second_high, second_low;
+        multiply_64(normalised, power[1], &second_high, &second_low);
+        low += second_high;
+        if (second_high > low){
+            high++;
+        }
+    }
+
+    const int upper_bit = (int) (high >> 63);
+    const int shift = upper_bit + 9;
+    unsigned long long mantissa = high >> shift;
+    /* floor(q * log2(10)) + 63, plus the exponent bias of 1023. */
+    int exponent = (((152170 + 65536) * q) >> 16) + 63 + upper_bit - lz + 1023;
+
+    if (exponent <= 0){
+        return 0;
+    }
+
+    /* Exactly halfway cases can only happen for small q. They are rounded to even instead of up. */
+    if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 && (mantissa << shift) == high){
+        mantissa &= ~1ULL;
+    }
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (2ULL << 52)){
+        mantissa = 1ULL << 52;
+        exponent++;
+    }
+    if (exponent >= 2047){
+        return 0;
+    }
+
+    unsigned long long bits = (mantissa & ~(1ULL << 52)) | ((unsigned long long) exponent << 52);
+    bits |= (unsigned long long) negative << 63;
+    memcpy(value, &bits, sizeof(double));
+
+    return 1;
+}
+
+/* Function to parse a decimal number in [start, end), with an optional sign, decimal point and exponent.
+ * Returns 1 and sets the value when the whole of the string has been parsed exactly as strtod would.
+ * Returns 0 for anything else, such as inf, nan, hexadecimal, more than 19 significant digits, or
+ * invalid characters, so the caller can fall back to strtod. */
+static int parse_double(const char *start, const char *end, double *value){
+    /* Powers of ten that are exactly representable as doubles. */
+    static const double EXACT_POWERS_OF_TEN[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = start;
+
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')){
+        negative = *p == '-';
+        p++;
+    }
+
+    /* Reads up to 19 significant digits, which always fit in 64 bits, counting the digits after the point. */
+    unsigned long long w = 0;
+    int digits = 0, significant = 0, fraction_digits = 0;
+    while (p < end && *p >= '0' && *p <= '9'){
+        if (w != 0 || *p != '0'){
+            significant++;
+        }
+        w = w * 10 + (unsigned long long) (*p - '0');
+        digits++;
+        p++;
+    }
+    if (p < end && *p == '.'){
+        p++;
+        while (p < end && *p >= '0' && *p <= '9'){
+            if (w != 0 || *p != '0'){
+                significant++;
+            }
+            w = w * 10 + (unsigned long long) (*p - '0');
+            digits++;
+            fraction_digits++;
+            p++;
+        }
+    }
+    if (digits == 0 || significant > 19){
+        return 0;
+    }
+
+    int exponent = 0;
+    if (p < end && (*p == 'e' || *p == 'E')){
+        p++;
+        int negative_exponent = 0;
+        if (p < end && (*p == '-' || *p == '+')){
+            negative_exponent = *p == '-';
+            p++;
+        }
+        if (p == end || *p < '0' || *p > '9'){
+            return 0;
+        }
+        while (p < end && *p >= '0' && *p <= '9'){
+            /* Exponents this large overflow or underflow whatever the digits are, so strtod handles them. */
+            if (exponent > 100000){
+                return 0;
+            }
+            exponent = exponent * 10 + (*p - '0');
+            p++;
+        }
+        exponent = negative_exponent ? -exponent : exponent;
+    }
+    if (p != end){
+        return 0;
+    }
+
+    const int q = exponent - fraction_digits;
+    if (w == 0){
+        *value = negative ? -0.0 : 0.0;
+        return 1;
+    }
+
+    /* Clinger's fast path: w and 10^|q| are both exact doubles, so one rounding gives the right answer. */
+    if (FLT_EVAL_METHOD == 0 && w <= (1ULL << 53) && q >= -22 && q <= 22){
+        double result = (double) w;
+        result = q < 0 ? result / EXACT_POWERS_OF_TEN[-q] : result * EXACT_POWERS_OF_TEN[q];
+        *value = negative ? -result : result;
+        return 1;
+    }
+
+    return eisel_lemire(w, q, negative, value);
+}
+
+/* Function to turn the current token into a double, returning 0 if it is not a valid number. */
+static int token_to_double(const Reader *reader, double *value){
+    const char *token = reader->token;
+    const char *token_end = token + reader->token_length;
+    char copy[64];
+
+    /* Plain decimal numbers are parsed directly, giving exactly the same result as strtod. */
+    if (parse_double(token, token_end, value)){
+        return 1;
+    }
+
+    /* strtod stops at the separator after the token, so it can read the file directly. Only a token
+     * right at the end of the file has no separator after it, and that one is copied first. */
+    if (token_end == reader->data + reader->size){
+        if (reader->token_length >= (int) sizeof(copy)){
+            return 0;
+        }
+        memcpy(copy, token, (size_t) reader->token_length);
+        copy[reader->token_length] = '\0';
+        token = copy;
+        token_end = copy + reader->token_length;
+    }
+
+    char *end_ptr;
+    /* Using strtod to change a string to a double. */
+    *value = strtod(token, &end_ptr);
+
+    /* Checks that there are no more characters after the value, using the end_ptr. */
+    return end_ptr == token_end;
+}
+
+/* Function to find the rows and columns of a matrix from the file, each at most max_rows_cols. */
+static Error read_rows_cols(int *rows, int *cols, const int max_rows_cols, Reader *reader){
+    /* Checks to make sure the first word of the first relevant line of the file is 'matrix'. */
+    if (!token_is(reader, "matrix")) {
+        return invalid_file(reader, "");
+    }
+
+    get_new_token(reader);
+    Error error = get_int(reader, max_rows_cols, rows);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    get_new_token(reader);
+    error = get_int(reader, max_rows_cols, cols);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    /* Retrieves the next token and checks that its the end of the line. */
+    get_new_token(reader);
+    if (!token_ends_line(reader)) {
+        return invalid_file(reader, "There are unexpected characters in the file.");
+    }
+
+    return NO_ERROR;
+}
+
+/* Function to move a sum of squares to the exponent that brings its sum near 1, if the sum is so big or
+ * small that adding to it might overflow or underflow. The exponent is of 4, so this is exact. */
+static void normalise_sum_squares(SumSquares *s){
+    if (s->sum == 0 || !isfinite(s->sum) || (s->sum >= NORM_SQUARE_MIN && s->sum <= NORM_SQUARE_MAX)){
+        return;
+    }
+
+    int exponent;
+    frexp(s->sum, &exponent);
+    const int shift = exponent / 2;
+    s->sum = ldexp(s->sum, -2 * shift);
+    s->compensation = ldexp(s->compensation, -2 * shift);
+    s->exponent += shift;
+}
+
+/* Function to add a term to the sum of a sum of squares, with Neumaier's compensated summation. */
+static void add_compensated(SumSquares *s, const double term){
+    const double sum = s->sum + term;
+
+    if (s->sum >= term){
+        s->compensation += (s->sum - sum) + term;
+    }
+    else {
+        s->compensation += (term - sum) + s->sum;
+    }
+    s->sum = sum;
+}
+
+/* Function to add one sum of squares to another. The one with the smaller exponent is scaled to the other's.
+ * Both sums are normalised first, so this only underflows for a part far too small to change the total. */
+static void add_sum_squares(SumSquares *total, SumSquares part){
+    if (part.sum == 0){
+        return;
+    }
+    /* Infinities and NaNs are passed straight on, whatever the exponents are. */
+    if (!isfinite(total->sum) || !isfinite(part.sum)){
+        total->sum += part.sum;
+        return;
+    }
+    if (total->sum == 0){
+        *total = part;
+        normalise_sum_squares(total);
+        return;
+    }
+
+    normalise_sum_squares(total);
+    normalise_sum_squares(&part);
+    if (part.exponent > total->exponent){
+        const SumSquares swap = *total;
+        *total = part;
+        part = swap;
+    }
+
+    const int shift = 2 * (part.exponent - total->exponent);
+    add_compensated(total, ldexp(part.sum, shift));
+    total->compensation += ldexp(part.compensation, shift);
+    normalise_sum_squares(total);
+}
+
+/* Function to add the square of one value to a sum of squares. Values whose squares could overflow or
+ * underflow are split into a fraction and an exponent first. */
+static void add_square(SumSquares *total, const double value){
+    const double square = value * value;
+
+    if (total->exponent == 0 && (value == 0 || (square >= NORM_SQUARE_MIN && square <= NORM_SQUARE_MAX))){
+        add_compensated(total, square);
+        return;
+    }
+
+    int exponent;
+    const double fraction = frexp(value, &exponent);
+    const SumSquares part = {fraction * fraction, 0, exponent};
+    add_sum_squares(total, part);
+}
+
+/* Function to find the square root of a sum of squares, which is the norm of the values summed. */
+static double sum_squares_root(const SumSquares *s){
+    if (!isfinite(s->sum)){
+        return sqrt(s->sum);
+    }
+
+    return ldexp(sqrt(s->sum + s->compensation), s->exponent);
+}
+
+/* Function to read the next row of a matrix from a file. The elements are stored in row, or if row is NULL,
+ * their squares are added to sum_squares instead. */
+static Error read_row(Reader *reader, const int cols, double *row, SumSquares *sum_squares){
+    Error error = read_line(reader);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    /* Loops finding matrix elements for as many columns stated in the file. */
+    for (int j=0; j<cols; j++) {
+        /* Checks that there is another matrix element when expected. */
+        if (reader->token == NULL) {
+            return invalid_file(reader, "Number of stated columns does not match file.");
+        }
+        /* Checks that the next token isn't the end of the file. */
+        if (token_is(reader, "end")){
+            return invalid_file(reader, "Number of stated rows does not match file.");
+        }
+
+        double value;
+        if (!token_to_double(reader, &value)){
+            return invalid_file(reader, "Matrix element is invalid.");
+        }
+        if (row != NULL){
+            row[j] = value;
+        }
+        else {
+            add_square(sum_squares, value);
+        }
+        get_new_token(reader);
+
+    }
+    /* Checks that there are no more strings when not expected, but allows comments. */
+    if (!token_ends_line(reader)) {
+        return invalid_file(reader, "Unexpected characters in the file.");
+    }
+
+    return NO_ERROR;
+}
+
+/* Function to create the matrix array with values from a file. */
+static Error read_array(Matrix *matrix, Reader *reader){
+    for (int i=0; i<matrix->rows; i++) {
+        Error error = read_row(reader, matrix->cols, &matrix->values[i*matrix->stride], NULL);
+        if (error != NO_ERROR){
+            return error;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+/* Function to find the end of a file. */
+static Error read_file_end(Reader *reader){
+    Error error = read_line(reader);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    /* Checks that the last line in the file contains the word 'end'. */
+    if (!token_is(reader, "end")) {
+        return invalid_file(reader, "Could not find the end of the file.");
+    }
+    /* Checks that there are no more strings when not expected, but allows comments. */
+    get_new_token(reader);
+    if (!token_ends_line(reader)) {
+        return invalid_file(reader, "Unexpected characters in the file.");
+    }
+
+    return NO_ERROR;
+}
+
+/* Function to move to the next line holding data before end, in the same way as read_line(), except that
+ * 0 is returned at the end instead of exiting. */
+static int read_chunk_line(Reader *reader, const char *end){
+    do {
+        const char *start = reader->next_line;
+        if (start >= end){
+            return 0;
+        }
+
+        const char *newline = memchr(start, '\n', (size_t) (end - start));
+        reader->line_end = newline != NULL ? newline : end;
+        reader->next_line = newline != NULL ? newline + 1 : end;
+        reader->cursor = start;
+
+        scan_token(reader);
+    } while (reader->token == NULL || reader->token[0] == '#');
+
+    return 1;
+}
+
+/* Function run by each task of the first pass of read_array_parallel(), counting the data lines in a chunk. */
+static void count_chunk_rows(void *arg, const int index){
+    ParseTask *task = arg;
+    ParseChunk *chunk = &task->chunks[index];
+    Reader line = *task->reader;
+
+    line.next_line = chunk->start;
+    chunk->rows = 0;
+    while (read_chunk_line(&line, chunk->end)){
+        chunk->rows++;
+    }
+}
+
+/* Function run by each task of the second pass of read_array_parallel(), parsing a chunk's data lines into
+ * their rows of the matrix, and checking the end line if it is in the chunk. The same checks are made as in
+ * read_array() and read_file_end(), but a failure is only recorded, so the error can be found in order. */
+static void parse_chunk_rows(void *arg, const int index){
+    ParseTask *task = arg;
+    ParseChunk *chunk = &task->chunks[index];
+    Matrix *matrix = task->matrix;
+    Reader line = *task->reader;
+
+    line.next_line = chunk->start;
+    for (int i=chunk->first_row; i<=matrix->rows && read_chunk_line(&line, chunk->end); i++){
+        if (i == matrix->rows){
+            if (!token_is(&line, "end")){
+                chunk->failed = 1;
+                return;
+            }
+            scan_token(&line);
+            chunk->failed = !token_ends_line(&line);
+            chunk->end_found = !chunk->failed;
+            return;
+        }
+
+        for (int j=0; j<matrix->cols; j++){
+            double value;
+            if (line.token == NULL || token_is(&line, "end") || !token_to_double(&line, &value)){
+                chunk->failed = 1;
+                return;
+            }
+            matrix->values[i*matrix->stride + j] = value;
+            scan_token(&line);
+        }
+        if (!token_ends_line(&line)){
+            chunk->failed = 1;
+            return;
+        }
+    }
+}
+
+/* Function to read the rows and end of a large text matrix file between the threads of the pool. The text
+ * after the header is split into a chunk for each thread at newlines. The data lines in each chunk are
+ * counted first, to find the row each chunk starts at, and then the chunks are parsed into their rows.
+ * If anything is wrong, the file is read again with read_array() and read_file_end(), which find the
+ * same error and line number as always. */
+static Error read_array_parallel(Matrix *matrix, Reader *reader){
+    const int chunk_count = pool->worker_count + 1;
+    const char *end = reader->data + reader->size;
+    const size_t chunk_size = (size_t) (end - reader->next_line) / chunk_count;
+
+    const ArenaMark mark = arena_mark();
+    ParseChunk *chunks = arena_alloc(sizeof(ParseChunk) * chunk_count);
+    if (chunks == NULL){
+        return MEMORY_ERROR;
+    }
+    for (int i=0; i<chunk_count; i++){
+        const char *start = i == 0 ? reader->next_line : chunks[i - 1].end;
+        const char *target = reader->next_line + chunk_size * (i + 1);
+        const char *newline = NULL;
+        if (i < chunk_count - 1 && start < end){
+            target = target > start ? target : start;
+            newline = memchr(target, '\n', (size_t) (end - target));
+        }
+
+        /* Each chunk ends after a newline, so lines are never split between chunks. */
+        chunks[i].start = start;
+        chunks[i].end = newline != NULL ? newline + 1 : end;
+        chunks[i].failed = 0;
+        chunks[i].end_found = 0;
+    }
+
+    ParseTask task = {matrix, reader, chunks};
+    run_parallel(pool, count_chunk_rows, &task, chunk_count);
+    int row = 0;
+    for (int i=0; i<chunk_count; i++){
+        chunks[i].first_row = row;
+        row += chunks[i].rows;
+    }
+    run_parallel(pool, parse_chunk_rows, &task, chunk_count);
+
+    int valid = 0;
+    for (int i=0; i<chunk_count && !chunks[i].failed; i++){
+        if (chunks[i].end_found){
+            valid = 1;
+            break;
+        }
+    }
+    arena_release(mark);
+
+    if (!valid){
+        Error error = read_array(matrix, reader);
+        return error != NO_ERROR ? error : read_file_end(reader);
+    }
+
+    return NO_ERROR;
+}
+
+/* Function to check whether this machine stores numbers little-endian, the same as binary matrix files. */
+static int is_little_endian(){
+    const unsigned int one = 1;
+    unsigned char first_byte;
+    memcpy(&first_byte, &one, 1);
+    return first_byte == 1;
+}
+
+/* Function to read an unsigned little-endian integer of the given number of bytes. */
+unsigned long long read_little_endian(const unsigned char *bytes, const int length){
+    unsigned long long value = 0;
+    for (int i=length-1; i>=0; i--){
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/* Function to write an unsigned little-endian integer of the given number of bytes. */
+void write_little_endian(unsigned char *bytes, const int length, unsigned long long value){
+    for (int i=0; i<length; i++){
+        bytes[i] = (unsigned char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+/* Function to reverse the bytes of each element, for machines that are not little-endian. */
+static void swap_element_bytes(double *values, const size_t count){
+    for (size_t i=0; i<count; i++){
+        unsigned char bytes[sizeof(double)];
+        memcpy(bytes, &values[i], sizeof(double));
+        for (int j=0; j<(int) sizeof(double)/2; j++){
+            unsigned char byte = bytes[j];
+            bytes[j] = bytes[sizeof(double) - 1 - j];
+            bytes[sizeof(double) - 1 - j] = byte;
+        }
+        memcpy(&values[i], bytes, sizeof(double));
+    }
+}
+
+/* Function to check whether the file being read is a binary matrix file rather than text. */
+static int is_binary_file(const Reader *reader){
+    return reader->size >= BINARY_MAGIC_LENGTH && memcmp(reader->data, BINARY_MAGIC, BINARY_MAGIC_LENGTH) == 0;
+}
+
+/* Function to check the header of a binary matrix file, finding the rows and columns, each at most
+ * max_rows_cols, the layout, and the offset of the elements. */
+static Error read_binary_header(Reader *reader, const int max_rows_cols, int *rows, int *cols, int *layout,
+                         size_t *offset){
+    const unsigned char *header = (const unsigned char *) reader->data;
+    if (reader->size < BINARY_HEADER_SIZE){
+        return invalid_file(reader, "The header is incomplete.");
+    }
+
+    if (read_little_endian(&header[8], 4) != BINARY_VERSION){
+        return invalid_file(reader, "The version is not supported.");
+    }
+    if (read_little_endian(&header[12], 4) != BINARY_DTYPE_FLOAT64){
+        return invalid_file(reader, "The element type is not supported.");
+    }
+    const unsigned long long layout_value = read_little_endian(&header[16], 4);
+    if (layout_value != BINARY_LAYOUT_ROW_MAJOR && layout_value != BINARY_LAYOUT_COL_MAJOR){
+        return invalid_file(reader, "The layout is not supported.");
+    }
+
+    const unsigned long long rows_value = read_little_endian(&header[24], 8);
+    const unsigned long long cols_value = read_little_endian(&header[32], 8);
+    if (rows_value < 1 || cols_value < 1){
+        return invalid_file(reader, "Stated rows or columns are invalid.");
+    }
+    if (rows_value > (unsigned long long) max_rows_cols || cols_value > (unsigned long long) max_rows_cols){
+        return invalid_file(reader, "Rows or columns of the matrix are bigger than the maximum value allowed.");
+    }
+
+    const unsigned long long offset_value = read_little_endian(&header[40], 8);
+    if (offset_value < BINARY_HEADER_SIZE || offset_value % sizeof(double) != 0 || offset_value > reader->size
+        || (reader->size - offset_value) / sizeof(double) < rows_value * cols_value){
+        return invalid_file(reader, "The elements do not fit in the file.");
+    }
+
+    *rows = (int) rows_value;
+    *cols = (int) cols_value;
+    *layout = (int) layout_value;
+    *offset = (size_t) offset_value;
+    return NO_ERROR;
+}
+
+/* Function to read a matrix from a binary matrix file. Row major elements in a mapped file are used where
+ * they are, so the matrix takes over the mapping and nothing is copied. Otherwise, for files read through
+ * a pipe, column major elements or machines that are not little-endian, the elements are copied and the
+ * file is released. The file is not released if reading fails. */
+static Error read_binary_matrix(Reader *reader, Matrix **matrix){
+    int rows, cols, layout;
+    size_t offset;
+    Error error = read_binary_header(reader, MAX_ROWS_COLS, &rows, &cols, &layout, &offset);
+    if (error != NO_ERROR){
+        return error;
+    }
+    double *elements = (double *) (reader->data + offset);
+
+    if (reader->mapped && layout == BINARY_LAYOUT_ROW_MAJOR && is_little_endian()){
+        *matrix = malloc(sizeof(Matrix));
+        if (*matrix == NULL){
+            return MEMORY_ERROR;
+        }
+        (*matrix)->rows = rows;
+        (*matrix)->cols = cols;
+        (*matrix)->stride = cols;
+        (*matrix)->values = elements;
+        (*matrix)->mapping = (void *) reader->data;
+        (*matrix)->mapping_size = reader->size;
+        return NO_ERROR;
+    }
+
+    *matrix = allocate_matrix(rows, cols);
+    if (*matrix == NULL){
+        return MEMORY_ERROR;
+    }
+    const int stride = (*matrix)->stride;
+    for (int i=0; i<rows; i++){
+        double *row = &(*matrix)->values[i*stride];
+        if (layout == BINARY_LAYOUT_ROW_MAJOR){
+            memcpy(row, &elements[i*cols], sizeof(double) * cols);
+        }
+        else {
+            /* Column major elements are the row major elements of the transpose. */
+            for (int j=0; j<cols; j++){
+                row[j] = elements[j*rows + i];
+            }
+        }
+        if (!is_little_endian()){
+            swap_element_bytes(row, (size_t) cols);
+        }
+    }
+
+    unmap_file(reader);
+    return NO_ERROR;
+}
+
+/* Function to set up a reader for a file from the start, once its data is in memory, recording any error in
+ * context. */
+static void start_reader(char *file_name, Reader *reader, Context *context){
+    reader->context = context;
+    context->file_name = file_name;
+    context->binary = 0;
+    context->message = "";
+    context->line_number = 0;
+    context->invalid_token_length = -1;
+    reader->next_line = reader->data;
+    reader->line_end = reader->data;
+    reader->cursor = reader->data;
+    reader->token = NULL;
+    reader->token_length = 0;
+    reader->line_number = 0;
+}
+
+/* Function to set up a reader for a file from the start, mapping the file into memory. */
+static Error open_reader(char *file_name, Reader *reader, Context *context){
+    context->file_name = file_name;
+    Error error = map_file(file_name, reader);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    start_reader(file_name, reader, context);
+    return NO_ERROR;
+}
+
+/* Function to read a matrix from a text or binary file whose reader has been set up, releasing the file's
+ * data unless the matrix is a mapping of it. Returns the same errors as load_matrix(). */
+static Error read_reader_matrix(Reader *reader, Matrix **matrix){
+    int rows, cols;
+    Error error;
+
+    if (is_binary_file(reader)){
+        reader->context->binary = 1;
+        error = read_binary_matrix(reader, matrix);
+        if (error != NO_ERROR){
+            unmap_file(reader);
+        }
+        return error;
+    }
+
+    error = read_line(reader);
+    if (error == NO_ERROR){
+        error = read_rows_cols(&rows, &cols, MAX_ROWS_COLS, reader);
+    }
+    if (error == NO_ERROR){
+        *matrix = allocate_matrix(rows, cols);
+        error = *matrix == NULL ? MEMORY_ERROR : NO_ERROR;
+    }
+    if (error == NO_ERROR){
+        /* Large files are parsed between the threads of the pool. */
+        if (pool != NULL && !in_pool_task
+            && (size_t) (reader->data + reader->size - reader->next_line) >= PARSE_PARALLEL_MIN){
+            error = read_array_parallel(*matrix, reader);
+        }
+        else {
+            error = read_array(*matrix, reader);
+            if (error == NO_ERROR){
+                error = read_file_end(reader);
+            }
+        }
+
+        if (error != NO_ERROR){
+            free_matrix(*matrix);
+            *matrix = NULL;
+        }
+    }
+
+    unmap_file(reader);
+    return error;
+}
+
+/* Function to load a matrix from a text or binary file, without printing anything or exiting. Sets matrix
+ * and returns NO_ERROR, or returns FILE_OPEN_ERROR, MEMORY_ERROR, or INVALID_FILE with the reason recorded
+ * in the context. The file is mapped into memory and scanned in place, so lines can be any length. None of
+ * the reading state is shared, so any number of files can be loaded at once from different threads.
+ * Binary matrix files are recognised by their first bytes, and read without parsing. */
+Error load_matrix(char *file_name, Matrix **matrix, Context *context){
+    Reader reader;
+    Error error = open_reader(file_name, &reader, context);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    return read_reader_matrix(&reader, matrix);
+}
+
+/* Function to load a matrix from the contents of a text or binary file already in memory, in the same way as
+ * load_matrix(). The data must have been allocated with malloc(), and is freed whether or not it is valid.
+ * name is used in place of the file name in the context. */
+Error load_matrix_buffer(char *name, char *data, const size_t size, Matrix **matrix, Context *context){
+    Reader reader;
+    reader.data = data;
+    reader.size = size;
+    reader.mapped = 0;
+    start_reader(name, &reader, context);
+
+    return read_reader_matrix(&reader, matrix);
+}
+
+/* Function to describe why load_matrix() could not load a matrix, in one line. */
+void describe_load_error(char *buffer, const size_t size, const Error error, const Context *context){
+    if (error == FILE_OPEN_ERROR){
+        snprintf(buffer, size, "Error opening the file %s.", context->file_name);
+    }
+    else if (error == MEMORY_ERROR){
+        snprintf(buffer, size, "Memory could not be allocated.");
+    }
+    else if (context->binary){
+        snprintf(buffer, size, "%s is an invalid binary matrix file. %s", context->file_name, context->message);
+    }
+    else if (context->invalid_token_length >= 0){
+        snprintf(buffer, size, "%s is an invalid matrix file. %s The invalid string in line %d of the file is %.*s",
+                 context->file_name, context->message, context->line_number, context->invalid_token_length,
+                 context->invalid_token);
+    }
+    else {
+        snprintf(buffer, size, "%s is an invalid matrix file. %s The invalid string in line %d of the file is (null)",
+                 context->file_name, context->message, context->line_number);
+    }
+}
+
+/* Function to release the pages of a mapped file that have been read while streaming through it, once there
+ * are STREAM_RELEASE_SIZE bytes of them, so the memory used does not grow with the size of the file.
+ * released is how far the file has been released, and position is how far it has been read. */
+static void release_read_pages(const Reader *reader, const char **released, const char *position){
+    if (!reader->mapped || position - *released < STREAM_RELEASE_SIZE){
+        return;
+    }
+
+    /* The mapping starts on a page, so whole pages are released up to the one holding position. */
+    const long page_size = sysconf(_SC_PAGESIZE);
+    const char *end = reader->data + (position - reader->data) / page_size * page_size;
+    madvise((void *) *released, (size_t) (end - *released), MADV_DONTNEED);
+    *released = end;
+}
+
+/* Function to find the sum of the squares of the elements of a matrix in a text or binary file, without
+ * storing the matrix. The file is read once from start to end, and the parts already read are released, so
+ * the memory used stays the same however big the matrix is, and it can have up to INT_MAX rows and columns.
+ * Files that cannot be mapped, such as pipes, are still read into memory first. Returns the same errors as
+ * load_matrix(). */
+static Error stream_sum_squares(char *file_name, SumSquares *sum_squares, Context *context){
+    int rows = 0, cols = 0;
+    *sum_squares = (SumSquares) {0, 0, 0};
+
+    Reader reader;
+    Error error = open_reader(file_name, &reader, context);
+    if (error != NO_ERROR){
+        return error;
+    }
+    const char *released = reader.data;
+
+    if (is_binary_file(&reader)){
+        context->binary = 1;
+        int layout;
+        size_t offset;
+        error = read_binary_header(&reader, INT_MAX, &rows, &cols, &layout, &offset);
+
+        if (error == NO_ERROR){
+            const double *elements = (const double *) (reader.data + offset);
+            const size_t count = (size_t) rows * cols;
+            const int swap = !is_little_endian();
+
+            for (size_t i=0; i<count; i++){
+                double value = elements[i];
+                if (swap){
+                    swap_element_bytes(&value, 1);
+                }
+                add_square(sum_squares, value);
+
+                if (i % 4096 == 0){
+                    release_read_pages(&reader, &released, (const char *) &elements[i]);
+                }
+            }
+        }
+    }
+    else {
+        error = read_line(&reader);
+        if (error == NO_ERROR){
+            error = read_rows_cols(&rows, &cols, INT_MAX, &reader);
+        }
+        for (int i=0; error == NO_ERROR && i<rows; i++){
+            error = read_row(&reader, cols, NULL, sum_squares);
+            release_read_pages(&reader, &released, reader.next_line);
+        }
+        if (error == NO_ERROR){
+            error = read_file_end(&reader);
+        }
+    }
+
+    unmap_file(&reader);
+    return error;
+}
+
+/* Function to find the frobenius norm of the matrix in a text or binary file while reading it, without
+ * storing the matrix, as stream_sum_squares() does. */
+Error stream_frob_norm(char *file_name, double *norm, Context *context){
+    SumSquares sum_squares;
+    Error error = stream_sum_squares(file_name, &sum_squares, context);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    *norm = sum_squares_root(&sum_squares);
+    return NO_ERROR;
+}
+
+/* Function to print the elements of a matrix to a file such as stderr, mainly used for testing the program. */
+void print_matrix(FILE *f, const Matrix *matrix){
+    for (int i=0; i<matrix->rows; i++){
+        for (int j=0; j<matrix->cols; j++){
+            fprintf(f, "%.12g\t", matrix->values[i*matrix->stride + j]);
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, "\n");
+}
+
+/* Scalar matrix product microkernel, for a 4 x 8 tile of C.
+ * The whole tile is accumulated in local variables, which the compiler keeps in registers. */
+static void gemm_kernel_scalar(const int kc, const double *a, const double *b, double *c, const int ldc){
+    double ab[4][8] = {{0}};
+
+    for (int p=0; p<kc; p++){
+        for (int i=0; i<4; i++){
+            for (int j=0; j<8; j++){
+                ab[i][j] += a[i] * b[j];
+            }
+        }
+        a += 4;
+        b += 8;
+    }
+
+    for (int i=0; i<4; i++){
+        for (int j=0; j<8; j++){
+            c[i*ldc + j] += ab[i][j];
+        }
+    }
+}
+
+/* Scalar kernel to find the sum of squares of an array. */
+static double sum_squares_scalar(const double *values, const long count){
+    double sum = 0;
+
+    for (long i=0; i<count; i++){
+        sum += values[i] * values[i];
+    }
+
+    return sum;
+}
+
+/* Scalar kernel to transpose a 4 x 4 tile. */
+static void transpose_scalar(const double *src, const int src_cols, double *dst, const int dst_cols){
+    for (int i=0; i<4; i++){
+        for (int j=0; j<4; j++){
+            dst[j*dst_cols + i] = src[i*src_cols + j];
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+/* AVX2 matrix product microkernel, for a 6 x 8 tile of C held in twelve vector registers. */
+__attribute__((target("avx2,fma")))
+static void gemm_kernel_avx2(const int kc, const double *a, const double *b, double *c, const int ldc){
+    __m256d ab[6][2];
+    for (int i=0; i<6; i++){
+        ab[i][0] = _mm256_setzero_pd();
+        ab[i][1] = _mm256_setzero_pd();
+    }
+
+    for (int p=0; p<kc; p++){
+        const __m256d b0 = _mm256_loadu_pd(b);
+        const __m256d b1 = _mm256_loadu_pd(b + 4);
+        for (int i=0; i<6; i++){
+            const __m256d ai = _mm256_broadcast_sd(&a[i]);
+            ab[i][0] = _mm256_fmadd_pd(ai, b0, ab[i][0]);
+            ab[i][1] = _mm256_fmadd_pd(ai, b1, ab[i][1]);
+        }
+        a += 6;
+        b += 8;
+    }
+
+    for (int i=0; i<6; i++){
+        _mm256_storeu_pd(&c[i*ldc], _mm256_add_pd(_mm256_loadu_pd(&c[i*ldc]), ab[i][0]));
+        _mm256_storeu_pd(&c[i*ldc + 4], _mm256_add_pd(_mm256_loadu_pd(&c[i*ldc + 4]), ab[i][1]));
+    }
+}
+
+/* AVX2 kernel to find the sum of squares of an array, with four independent accumulators. */
+__attribute__((target("avx2,fma")))
+static double sum_squares_avx2(const double *values, const long count){
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    __m256d sum2 = _mm256_setzero_pd(), sum3 = _mm256_setzero_pd();
+    long i = 0;
+
+    for (; i+16<=count; i+=16){
+        const __m256d x0 = _mm256_loadu_pd(&values[i]), x1 = _mm256_loadu_pd(&values[i+4]);
+        const __m256d x2 = _mm256_loadu_pd(&values[i+8]), x3 = _mm256_loadu_pd(&values[i+12]);
+        sum0 = _mm256_fmadd_pd(x0, x0, sum0);
+        sum1 = _mm256_fmadd_pd(x1, x1, sum1);
+        sum2 = _mm256_fmadd_pd(x2, x2, sum2);
+        sum3 = _mm256_fmadd_pd(x3, x3, sum3);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(sum0, sum1), _mm256_add_pd(sum2, sum3)));
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+
+    return sum + sum_squares_scalar(&values[i], count - i);
+}
+
+/* AVX2 kernel to transpose a 4 x 4 tile, interleaving pairs of rows and then swapping 128 bit halves. */
+__attribute__((target("avx2")))
+static void transpose_avx2(const double *src, const int src_cols, double *dst, const int dst_cols){
+    const __m256d r0 = _mm256_loadu_pd(&src[0]), r1 = _mm256_loadu_pd(&src[src_cols]);
+    const __m256d r2 = _mm256_loadu_pd(&src[2*src_cols]), r3 = _mm256_loadu_pd(&src[3*src_cols]);
+
+    const __m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1);
+    const __m256d t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+
+    _mm256_storeu_pd(&dst[0], _mm256_permute2f128_pd(t0, t2, 0x20));
+    _mm256_storeu_pd(&dst[dst_cols], _mm256_permute2f128_pd(t1, t3, 0x20));
+    _mm256_storeu_pd(&dst[2*dst_cols], _mm256_permute2f128_pd(t0, t2, 0x31));
+    _mm256_storeu_pd(&dst[3*dst_cols], _mm256_permute2f128_pd(t1, t3, 0x31));
+}
+
+/* AVX-512 matrix product microkernel, for an 8 x 16 tile of C held in sixteen vector registers. */
+__attribute__((target("avx512f")))
+static void gemm_kernel_avx512(const int kc, const double *a, const double *b, double *c, const int ldc){
+    __m512d ab[8][2];
+    for (int i=0; i<8; i++){
+        ab[i][0] = _mm512_setzero_pd();
+        ab[i][1] = _mm512_setzero_pd();
+    }
+
+    for (int p=0; p<kc; p++){
+        const __m512d b0 = _mm512_loadu_pd(b);
+        const __m512d b1 = _mm512_loadu_pd(b + 8);
+        for (int i=0; i<8; i++){
+            const __m512d ai = _mm512_set1_pd(a[i]);
+            ab[i][0] = _mm512_fmadd_pd(ai, b0, ab[i][0]);
+            ab[i][1] = _mm512_fmadd_pd(ai, b1, ab[i][1]);
+        }
+        a += 8;
+        b += 16;
+    }
+
+    for (int i=0; i<8; i++){
+        _mm512_storeu_pd(&c[i*ldc], _mm512_add_pd(_mm512_loadu_pd(&c[i*ldc]), ab[i][0]));
+        _mm512_storeu_pd(&c[i*ldc + 8], _mm512_add_pd(_mm512_loadu_pd(&c[i*ldc + 8]), ab[i][1]));
+    }
+}
+
+/* AVX-512 kernel to find the sum of squares of an array, with four independent accumulators. */
+__attribute__((target("avx512f")))
+static double sum_squares_avx512(const double *values, const long count){
+    __m512d sum0 = _mm512_setzero_pd(), sum1 = _mm512_setzero_pd();
+    __m512d sum2 = _mm512_setzero_pd(), sum3 = _mm512_setzero_pd();
+    long i = 0;
+
+    for (; i+32<=count; i+=32){
+        const __m512d x0 = _mm512_loadu_pd(&values[i]), x1 = _mm512_loadu_pd(&values[i+8]);
+        const __m512d x2 = _mm512_loadu_pd(&values[i+16]), x3 = _mm512_loadu_pd(&values[i+24]);
+        sum0 = _mm512_fmadd_pd(x0, x0, sum0);
+        sum1 = _mm512_fmadd_pd(x1, x1, sum1);
+        sum2 = _mm512_fmadd_pd(x2, x2, sum2);
+        sum3 = _mm512_fmadd_pd(x3, x3, sum3);
+    }
+
+    double sum = _mm512_reduce_add_pd(_mm512_add_pd(_mm512_add_pd(sum0, sum1), _mm512_add_pd(sum2, sum3)));
+
+    return sum + sum_squares_scalar(&values[i], count - i);
+}
+
+/* AVX-512 kernel to transpose an 8 x 8 tile. Pairs of rows are interleaved,
+ * then 128 bit lanes are gathered in two rounds of shuffles. */
+__attribute__((target("avx512f")))
+static void transpose_avx512(const double *src, const int src_cols, double *dst, const int dst_cols){
+    __m512d r[8], t[8];
+    for (int i=0; i<8; i++){
+        r[i] = _mm512_loadu_pd(&src[i*src_cols]);
+    }
+
+    /* t[2i] holds elements 0, 2, 4, 6 and t[2i+1] elements 1, 3, 5, 7 of rows 2i and 2i+1. */
+    for (int i=0; i<4; i++){
+        t[2*i] = _mm512_unpacklo_pd(r[2*i], r[2*i+1]);
+        t[2*i+1] = _mm512_unpackhi_pd(r[2*i], r[2*i+1]);
+    }
+
+    for (int odd=0; odd<2; odd++){
+        const __m512d v0 = _mm512_shuffle_f64x2(t[odd], t[2+odd], 0x88);
+        const __m512d v1 = _mm512_shuffle_f64x2(t[4+odd], t[6+odd], 0x88);
+        const __m512d v2 = _mm512_shuffle_f64x2(t[odd], t[2+odd], 0xDD);
+        const __m512d v3 = _mm512_shuffle_f64x2(t[4+odd], t[6+odd], 0xDD);
+
+        _mm512_storeu_pd(&dst[odd*dst_cols], _mm512_shuffle_f64x2(v0, v1, 0x88));
+        _mm512_storeu_pd(&dst[(4+odd)*dst_cols], _mm512_shuffle_f64x2(v0, v1, 0xDD));
+        _mm512_storeu_pd(&dst[(2+odd)*dst_cols], _mm512_shuffle_f64x2(v2, v3, 0x88));
+        _mm512_storeu_pd(&dst[(6+odd)*dst_cols], _mm512_shuffle_f64x2(v2, v3, 0xDD));
+    }
+}
+#endif
+
+/* Kernels used by the hot loops, set by select_kernels() at startup. */
+static Kernels kernels = {"scalar", 4, 8, gemm_kernel_scalar, sum_squares_scalar, 4, transpose_scalar};
+
+/* Function to choose the fastest kernels the CPU supports, checked with cpuid.
+ * The scalar kernels are kept when no supported SIMD instruction set is found. */
+static void select_kernels(){
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f")){
+        Kernels avx512 = {"avx512", 8, 16, gemm_kernel_avx512, sum_squares_avx512, 8, transpose_avx512};
+        kernels = avx512;
+    }
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+        Kernels avx2 = {"avx2", 6, 8, gemm_kernel_avx2, sum_squares_avx2, 4, transpose_avx2};
+        kernels = avx2;
+    }
+#endif
+}
+
+/* Function to set up the library before it is used, choosing the kernels and starting a pool of threads
+ * threads in total if there is more than one. Returns MEMORY_ERROR if the pool cannot be created. */
+Error start_matrix_calc(const int threads){
+    select_kernels();
+    if (pthread_key_create(&thread_memory_key, free_thread_memory) != 0){
+        return MEMORY_ERROR;
+    }
+
+    if (threads > 1){
+        pool = create_thread_pool(threads);
+        if (pool == NULL){
+            return MEMORY_ERROR;
+        }
+    }
+
+    return NO_ERROR;
+}
+
+/* Function to stop the pool's threads once the library is no longer needed. */
+void stop_matrix_calc(void){
+    if (pool != NULL){
+        free_thread_pool(pool);
+        pool = NULL;
+    }
+
+    /* The workers' arenas and pools were freed as they ended, and the caller's are freed here. */
+    free_arena();
+    free_matrix_pool();
+    pthread_setspecific(thread_memory_key, NULL);
+    pthread_key_delete(thread_memory_key);
+}
+
+/* Function to choose how the values of matrices of at least LARGE_MATRIX_SIZE bytes allocated from now on are
+ * placed in memory, with any of the PLACE_ flags, or 0 for the default of allocating them with malloc(). */
+void set_matrix_placement(const int flags){
+    placement = flags;
+}
+
+/* Function to find the sum of the squares of up to NORM_BLOCK_SIZE values with the kernel. If the kernel's sum
+ * shows that squares may have overflowed or underflowed, the values are scaled by a power of two that brings
+ * the largest near 1 and summed again. */
+static SumSquares block_sum_squares(const double *values, const int count){
+    SumSquares result = {kernels.sum_squares(values, count), 0, 0};
+
+    /* A NaN element makes the sum NaN, which is passed on as it is. */
+    if ((result.sum >= NORM_SQUARE_MIN && result.sum <= DBL_MAX) || isnan(result.sum)){
+        return result;
+    }
+
+    double max = 0;
+    for (int i=0; i<count; i++){
+        max = fmax(max, fabs(values[i]));
+    }
+    if (max == 0 || isinf(max)){
+        result.sum = max;
+        return result;
+    }
+
+    /* 2^-exponent must be a normal double, so the smallest values are scaled up less. Their squares still
+     * cannot underflow. */
+    int exponent;
+    frexp(max, &exponent);
+    exponent = exponent < -1000 ? -1000 : exponent;
+    const double scale = ldexp(1, -exponent);
+
+    double scaled[NORM_BLOCK_SIZE];
+    for (int i=0; i<count; i++){
+        scaled[i] = values[i] * scale;
+    }
+    result.sum = kernels.sum_squares(scaled, count);
+    result.exponent = exponent;
+
+    return result;
+}
+
+/* Pool task finding the sum of squares of one chunk of a matrix, a block at a time. Blocks end at the end of
+ * each row, so the kernel only sums elements that are next to each other. */
+static void sum_squares_chunk(void *arg, int index){
+    const NormTask *t = arg;
+    const long start = (long) index * NORM_CHUNK_SIZE;
+    const long end = t->count - start < NORM_CHUNK_SIZE ? t->count : start + NORM_CHUNK_SIZE;
+    SumSquares total = {0, 0, 0};
+
+    for (long i=start; i<end; ){
+        const long row = i / t->cols, col = i % t->cols;
+        long count = end - i < NORM_BLOCK_SIZE ? end - i : NORM_BLOCK_SIZE;
+        count = count < t->cols - col ? count : t->cols - col;
+        add_sum_squares(&total, block_sum_squares(&t->values[row*t->stride + col], (int) count));
+        i += count;
+    }
+
+    t->sums[index] = total;
+}
+
+/* Function to calculate the frobenius norm of a matrix. The matrix is split into chunks shared between the
+ * threads of the pool, and their sums are added in order, so the result does not depend on the number of
+ * threads. It cannot overflow or underflow unless the norm itself does. */
+Error get_frob_norm(const Matrix *matrix, double *norm){
+    /* Where each value is does not matter, so a matrix without padding is summed as one long row. */
+    const long count = (long) matrix->rows * matrix->cols;
+    const int chunks = (int) ((count + NORM_CHUNK_SIZE - 1) / NORM_CHUNK_SIZE);
+    const long cols = matrix->stride == matrix->cols ? count : matrix->cols;
+
+    const ArenaMark mark = arena_mark();
+    NormTask task = {matrix->values, count, cols, matrix->stride, arena_alloc(sizeof(SumSquares) * chunks)};
+    if (task.sums == NULL){
+        return MEMORY_ERROR;
+    }
+    run_parallel(pool, sum_squares_chunk, &task, chunks);
+
+    SumSquares total = {0, 0, 0};
+    for (int i=0; i<chunks; i++){
+        add_sum_squares(&total, task.sums[i]);
+    }
+    arena_release(mark);
+
+    /* Sets the square root of the summed value of each matrix element squared. */
+    *norm = sum_squares_root(&total);
+    return NO_ERROR;
+}
+
+/* Function to transpose a rows x cols block of src into dst, using the kernel for full tiles
+ * and copying the remaining right hand columns and bottom rows one element at a time. */
+static void transpose_tiles(const double *src, const int src_cols, double *dst, const int dst_cols,
+                     const int rows, const int cols){
+    const int size = kernels.transpose_size;
+    const int full_rows = rows - rows % size;
+    const int full_cols = cols - cols % size;
+
+    for (int i=0; i<full_rows; i+=size){
+        for (int j=0; j<full_cols; j+=size){
+            kernels.transpose(&src[i*src_cols + j], src_cols, &dst[j*dst_cols + i], dst_cols);
+        }
+    }
+
+    for (int i=0; i<rows; i++){
+        for (int j=(i < full_rows ? full_cols : 0); j<cols; j++){
+            dst[j*dst_cols + i] = src[i*src_cols + j];
+        }
+    }
+}
+
+/* Recursive function to transpose a rows x cols block of src into dst. The longer side is halved until
+ * the block fits in the cache, so both matrices are read and written in cache sized pieces whatever
+ * the cache sizes are. Halves are kept to a multiple of the kernel size where possible. */
+static void transpose_recursive(const double *src, const int src_cols, double *dst, const int dst_cols,
+                         const int rows, const int cols){
+    if (rows <= TRANSPOSE_BLOCK_SIZE && cols <= TRANSPOSE_BLOCK_SIZE){
+        transpose_tiles(src, src_cols, dst, dst_cols, rows, cols);
+        return;
+    }
+
+    if (rows >= cols){
+        int half = rows / 2 - (rows / 2) % kernels.transpose_size;
+        half = half > 0 ? half : rows / 2;
+        transpose_recursive(src, src_cols, dst, dst_cols, half, cols);
+        transpose_recursive(&src[half*src_cols], src_cols, &dst[half], dst_cols, rows - half, cols);
+    }
+    else {
+        int half = cols / 2 - (cols / 2) % kernels.transpose_size;
+        half = half > 0 ? half : cols / 2;
+        transpose_recursive(src, src_cols, dst, dst_cols, rows, half);
+        transpose_recursive(&src[half], src_cols, &dst[half*dst_cols], dst_cols, rows, cols - half);
+    }
+}
+
+/* Function to find the transpose of a matrix. */
+Error get_transpose(const Matrix *matrix, Matrix **transpose){
+    /* Creates new matrix to return from the function. */
+    Matrix *new_mat = allocate_matrix(matrix->cols, matrix->rows);
+    if (new_mat == NULL){
+        return MEMORY_ERROR;
+    }
+
+    transpose_recursive(matrix->values, matrix->stride, new_mat->values, new_mat->stride, matrix->rows, matrix->cols);
+
+    *transpose = new_mat;
+    return NO_ERROR;
+}
+
+/* Function to transpose a square matrix in place. Each pair of opposite blocks is swapped through a
+ * small buffer, and each block on the diagonal is transposed through the same buffer. */
+static void transpose_square_in_place(Matrix *matrix){
+    const int n = matrix->rows;
+    const int ld = matrix->stride;
+    double buffer[TRANSPOSE_BLOCK_SIZE*TRANSPOSE_BLOCK_SIZE];
+
+    for (int bi=0; bi<n; bi+=TRANSPOSE_BLOCK_SIZE){
+        const int rows = n - bi < TRANSPOSE_BLOCK_SIZE ? n - bi : TRANSPOSE_BLOCK_SIZE;
+        double *diagonal = &matrix->values[bi*ld + bi];
+
+        transpose_tiles(diagonal, ld, buffer, rows, rows, rows);
+        for (int i=0; i<rows; i++){
+            memcpy(&diagonal[i*ld], &buffer[i*rows], sizeof(double) * rows);
+        }
+
+        for (int bj=bi+rows; bj<n; bj+=TRANSPOSE_BLOCK_SIZE){
+            const int cols = n - bj < TRANSPOSE_BLOCK_SIZE ? n - bj : TRANSPOSE_BLOCK_SIZE;
+            double *upper = &matrix->values[bi*ld + bj];
+            double *lower = &matrix->values[bj*ld + bi];
+
+            /* The buffer holds the transpose of the upper block while the lower block's transpose replaces it. */
+            transpose_tiles(upper, ld, buffer, rows, rows, cols);
+            transpose_tiles(lower, ld, upper, ld, cols, rows);
+            for (int i=0; i<cols; i++){
+                memcpy(&lower[i*ld], &buffer[i*rows], sizeof(double) * rows);
+            }
+        }
+    }
+}
+
+/* Function to move the first rows rows of cols elements from one stride to another in place. Rows move towards
+ * the start when the stride shrinks and towards the end when it grows, so they are moved from that end first. */
+static void restride_rows(double *values, const int rows, const int cols, const int from, const int to){
+    if (to < from){
+        for (int i=1; i<rows; i++){
+            memmove(&values[(size_t) i*to], &values[(size_t) i*from], sizeof(double) * cols);
+        }
+    }
+    else if (to > from){
+        for (int i=rows-1; i>0; i--){
+            memmove(&values[(size_t) i*to], &values[(size_t) i*from], sizeof(double) * cols);
+        }
+    }
+}
+
+/* Function to transpose a rectangular matrix in place by following the cycles of the permutation.
+ * The rows are packed together first, then the element at index k moves to index k*rows mod (N-1), where
+ * N is the number of elements, and a bitmap of N bits records which elements have already been moved.
+ * The new rows are padded again if the padded stride fits in the memory the matrix already has. */
+static Error transpose_rectangular_in_place(Matrix *matrix){
+    const size_t count = (size_t) matrix->rows * matrix->cols;
+    const ArenaMark mark = arena_mark();
+    unsigned char *moved = arena_alloc((count + 7) / 8);
+    if (moved == NULL){
+        return MEMORY_ERROR;
+    }
+    memset(moved, 0, (count + 7) / 8);
+    const size_t capacity = (size_t) matrix->rows * matrix->stride;
+    restride_rows(matrix->values, matrix->rows, matrix->cols, matrix->stride, matrix->cols);
+
+    /* The first and last elements never move. */
+    for (size_t start=1; start+1<count; start++){
+        if (moved[start / 8] & (1 << (start % 8))){
+            continue;
+        }
+
+        double value = matrix->values[start];
+        size_t position = start;
+        do {
+            position = (position * matrix->rows) % (count - 1);
+            double next = matrix->values[position];
+            matrix->values[position] = value;
+            value = next;
+            moved[position / 8] |= (unsigned char) (1 << (position % 8));
+        } while (position != start);
+    }
+
+    arena_release(mark);
+
+    const int rows = matrix->rows;
+    matrix->rows = matrix->cols;
+    matrix->cols = rows;
+    matrix->stride = matrix_stride(matrix->cols);
+    if ((size_t) matrix->rows * matrix->stride > capacity){
+        matrix->stride = matrix->cols;
+    }
+    restride_rows(matrix->values, matrix->rows, matrix->cols, matrix->cols, matrix->stride);
+    return NO_ERROR;
+}
+
+/* Function to transpose a matrix in place, so no second matrix has to be allocated. Only a rectangular
+ * matrix needs any memory, for its bitmap, and it is left unchanged if there is not enough. */
+Error transpose_in_place(Matrix *matrix){
+    if (matrix->rows == matrix->cols){
+        transpose_square_in_place(matrix);
+        return NO_ERROR;
+    }
+
+    return transpose_rectangular_in_place(matrix);
+}
+
+/* Function to pack a block of A (the view, scaled by alpha) into panels of mr rows. Each panel is stored
+ * column by column, so the microkernel reads it contiguously. Rows of the view are read a run at a time,
+ * which steps over any row or column it leaves out, and rows past the end of a partial panel are filled with 0. */
+static void pack_a(const MatrixView *a, const double alpha, const int mr, double *packed){
+    const int kc = a->cols;
+
+    for (int ir=0; ir<a->rows; ir+=mr){
+        const int rows = a->rows - ir < mr ? a->rows - ir : mr;
+
+        for (int i=0; i<rows; i++){
+            const double *row = view_row(a, ir+i);
+            for (int p=0; p<kc; ){
+                const int run = view_run(a, p);
+                const double *elements = &row[view_col_index(a, p)];
+                for (int q=0; q<run; q++){
+                    packed[(p+q)*mr + i] = alpha * elements[q];
+                }
+                p += run;
+            }
+        }
+        for (int i=rows; i<mr; i++){
+            for (int p=0; p<kc; p++){
+                packed[p*mr + i] = 0;
+            }
+        }
+        packed += kc * mr;
+    }
+}
+
+/* Function to pack a block of B (the view) into panels of nr columns. Each panel is stored row by row,
+ * and columns past the end of a partial panel are filled with 0. */
+static void pack_b(const MatrixView *b, const int nr, double *packed){
+    for (int jr=0; jr<b->cols; jr+=nr){
+        const int cols = b->cols - jr < nr ? b->cols - jr : nr;
+
+        for (int p=0; p<b->rows; p++){
+            const double *row = view_row(b, p);
+            for (int j=0; j<cols; ){
+                const int run = view_run(b, jr+j) < cols - j ? view_run(b, jr+j) : cols - j;
+                memcpy(&packed[j], &row[view_col_index(b, jr+j)], sizeof(double) * run);
+                j += run;
+            }
+            for (int j=cols; j<nr; j++){
+                packed[j] = 0;
+            }
+            packed += nr;
+        }
+    }
+}
+
+/* Function to add alpha*A*B to C on the calling thread. The arguments are the same as for gemm().
+ * B is split into blocks of GEMM_KC x GEMM_NC and A into blocks of GEMM_MC x GEMM_KC, which are packed
+ * into contiguous buffers sized for the caches, and then multiplied tile by tile by the selected microkernel.
+ * If the buffers cannot be allocated, the product is found without packing, which is slower but cannot fail. */
+static void gemm_block(const double alpha, const MatrixView *a, const MatrixView *b, MatrixView *c){
+    const int m = c->rows, n = c->cols, k = a->cols;
+    const int ldc = c->stride;
+
+    const int mr = kernels.gemm_mr;
+    const int nr = kernels.gemm_nr;
+
+    /* The buffers hold the largest blocks, with their partial panels filled out to whole ones. GEMM_MC and
+     * GEMM_NC are multiples of every kernel's tile size, so the panels of full blocks never overrun. */
+    const int mc_max = m < GEMM_MC ? (m + mr - 1) / mr * mr : GEMM_MC;
+    const int kc_max = k < GEMM_KC ? k : GEMM_KC;
+    const int nc_max = n < GEMM_NC ? (n + nr - 1) / nr * nr : GEMM_NC;
+    const ArenaMark mark = arena_mark();
+    double *packed_a = arena_alloc(sizeof(double) * mc_max * kc_max);
+    double *packed_b = arena_alloc(sizeof(double) * kc_max * nc_max);
+    if (packed_a == NULL || packed_b == NULL){
+        arena_release(mark);
+
+        for (int i=0; i<m; i++){
+            for (int p=0; p<k; p++){
+                const double scaled = alpha * *view_element(a, i, p);
+                for (int j=0; j<n; j++){
+                    c->values[i*ldc + j] += scaled * *view_element(b, p, j);
+                }
+            }
+        }
+        return;
+    }
+
+    for (int jc=0; jc<n; jc+=GEMM_NC){
+        const int nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+
+        for (int pc=0; pc<k; pc+=GEMM_KC){
+            const int kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            const MatrixView b_block = view_block(b, pc, jc, kc, nc);
+            pack_b(&b_block, nr, packed_b);
+
+            for (int ic=0; ic<m; ic+=GEMM_MC){
+                const int mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+                const MatrixView a_block = view_block(a, ic, pc, mc, kc);
+                pack_a(&a_block, alpha, mr, packed_a);
+
+                for (int jr=0; jr<nc; jr+=nr){
+                    const int cols = nc - jr < nr ? nc - jr : nr;
+
+                    for (int ir=0; ir<mc; ir+=mr){
+                        const int rows = mc - ir < mr ? mc - ir : mr;
+                        double *c_tile = &c->values[(ic+ir)*ldc + jc+jr];
+
+                        if (rows == mr && cols == nr){
+                            kernels.gemm(kc, &packed_a[ir*kc], &packed_b[jr*kc], c_tile, ldc);
+                        }
+                        else {
+                            /* Partial tiles at the edges of C are computed in a full sized buffer. */
+                            double edge[GEMM_MAX_TILE] = {0};
+                            kernels.gemm(kc, &packed_a[ir*kc], &packed_b[jr*kc], edge, nr);
+                            for (int i=0; i<rows; i++){
+                                for (int j=0; j<cols; j++){
+                                    c_tile[i*ldc + j] += edge[i*nr + j];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    arena_release(mark);
+}
+
+/* Pool task computing one tile of C in a parallel product. Each tile packs its own blocks of A and B. */
+static void gemm_tile(void *arg, int index){
+    const GemmTask *t = arg;
+    const int i = (index / t->col_tiles) * t->tile_rows;
+    const int j = (index % t->col_tiles) * t->tile_cols;
+    const int rows = t->c.rows - i < t->tile_rows ? t->c.rows - i : t->tile_rows;
+    const int cols = t->c.cols - j < t->tile_cols ? t->c.cols - j : t->tile_cols;
+
+    const MatrixView a = view_block(&t->a, i, 0, rows, t->a.cols);
+    const MatrixView b = view_block(&t->b, 0, j, t->b.rows, cols);
+    MatrixView c = view_block(&t->c, i, j, rows, cols);
+    gemm_block(t->alpha, &a, &b, &c);
+}
+
+/* Function to add alpha*A*B to C, where A is m x k, B is k x n and C is m x n. A and B can be any views, but C
+ * must not leave out a row or column. Large products are split into 2D tiles of C, which are shared between
+ * the threads of the pool. */
+static void gemm(const double alpha, const MatrixView *a, const MatrixView *b, MatrixView *c){
+    const int m = c->rows, n = c->cols, k = a->cols;
+    const int threads = pool == NULL ? 1 : pool->worker_count + 1;
+
+    if (threads == 1 || (double) m * n * k < GEMM_PARALLEL_MIN){
+        gemm_block(alpha, a, b, c);
+        return;
+    }
+
+    GemmTask task = {alpha, *a, *b, *c, 0, 0, 0};
+    choose_gemm_tiles(m, n, threads, &task.tile_rows, &task.tile_cols);
+
+    const int row_tiles = (m + task.tile_rows - 1) / task.tile_rows;
+    task.col_tiles = (n + task.tile_cols - 1) / task.tile_cols;
+    run_parallel(pool, gemm_tile, &task, row_tiles * task.col_tiles);
+}
+
+/* Function to calculate the product of two views, returning INVALID_MATRIX if the columns of the first
+ * do not match the rows of the second. */
+Error get_view_product(const MatrixView *view1, const MatrixView *view2, Matrix **product){
+    if (view1->cols != view2->rows){
+        return INVALID_MATRIX;
+    }
+    Matrix *new_mat = allocate_zero_matrix(view1->rows, view2->cols);
+    if (new_mat == NULL){
+        return MEMORY_ERROR;
+    }
+
+    MatrixView c = view_matrix(new_mat);
+    gemm(1, view1, view2, &c);
+
+    *product = new_mat;
+    return NO_ERROR;
+}
+
+/* Function to calculate the product of two matrices, returning INVALID_MATRIX if the columns of the first
+ * do not match the rows of the second. */
+Error get_product(const Matrix *matrix1, const Matrix *matrix2, Matrix **product) {
+    const MatrixView view1 = view_matrix(matrix1);
+    const MatrixView view2 = view_matrix(matrix2);
+
+    return get_view_product(&view1, &view2, product);
+}
+
+/* Function to set Z = X + sign*Y for views of the same size. Z may be the same block as X or Y. Each row is
+ * added in runs of columns that are next to each other in all three views. */
+static void add_blocks(const MatrixView *x, const double sign, const MatrixView *y, MatrixView *z){
+    for (int i=0; i<z->rows; i++){
+        const double *x_row = view_row(x, i), *y_row = view_row(y, i);
+        double *z_row = view_row(z, i);
+
+        for (int j=0; j<z->cols; ){
+            int run = view_run(z, j);
+            run = view_run(x, j) < run ? view_run(x, j) : run;
+            run = view_run(y, j) < run ? view_run(y, j) : run;
+
+            const double *xs = &x_row[view_col_index(x, j)], *ys = &y_row[view_col_index(y, j)];
+            double *zs = &z_row[view_col_index(z, j)];
+            for (int k=0; k<run; k++){
+                zs[k] = xs[k] + sign * ys[k];
+            }
+            j += run;
+        }
+    }
+}
+
+/* Function to set C = A*B for n x n views with the Strassen-Winograd algorithm, which uses 7 half sized
+ * products and 15 additions instead of 8 products. The products are found recursively until they are no
+ * bigger than cutoff, and then with the blocked kernel. Odd sizes are handled by peeling off the last row
+ * and column, which are then added with thin classical products. If the temporaries for a level cannot be
+ * allocated, that level uses the blocked kernel instead. As for gemm(), C must not leave anything out. */
+static void strassen(const MatrixView *a, const MatrixView *b, MatrixView *c, const int cutoff){
+    const int n = c->rows;
+
+    if (n <= cutoff){
+        for (int i=0; i<n; i++){
+            memset(&c->values[i*c->stride], 0, sizeof(double) * n);
+        }
+        gemm(1, a, b, c);
+        return;
+    }
+
+    if (n % 2 == 1){
+        const int m = n - 1;
+        const MatrixView a11 = view_block(a, 0, 0, m, m), b11 = view_block(b, 0, 0, m, m);
+        MatrixView c11 = view_block(c, 0, 0, m, m);
+        strassen(&a11, &b11, &c11, cutoff);
+
+        /* C11 += a12*b21, then the last column and last row of C are found directly. */
+        const MatrixView a12 = view_block(a, 0, m, m, 1), b21 = view_block(b, m, 0, 1, m);
+        gemm(1, &a12, &b21, &c11);
+        for (int i=0; i<m; i++){
+            c->values[i*c->stride + m] = 0;
+        }
+        memset(&c->values[m*c->stride], 0, sizeof(double) * n);
+
+        const MatrixView a_top = view_block(a, 0, 0, m, n), b_right = view_block(b, 0, m, n, 1);
+        const MatrixView a_bottom = view_block(a, m, 0, 1, n);
+        MatrixView c_right = view_block(c, 0, m, m, 1), c_bottom = view_block(c, m, 0, 1, n);
+        gemm(1, &a_top, &b_right, &c_right);
+        gemm(1, &a_bottom, b, &c_bottom);
+        return;
+    }
+
+    const int h = n / 2;
+    const MatrixView a11 = view_block(a, 0, 0, h, h), a12 = view_block(a, 0, h, h, h);
+    const MatrixView a21 = view_block(a, h, 0, h, h), a22 = view_block(a, h, h, h, h);
+    const MatrixView b11 = view_block(b, 0, 0, h, h), b12 = view_block(b, 0, h, h, h);
+    const MatrixView b21 = view_block(b, h, 0, h, h), b22 = view_block(b, h, h, h, h);
+    MatrixView c11 = view_block(c, 0, 0, h, h), c12 = view_block(c, 0, h, h, h);
+    MatrixView c21 = view_block(c, h, 0, h, h), c22 = view_block(c, h, h, h, h);
+
+    const ArenaMark mark = arena_mark();
+    MatrixView x = {arena_alloc(sizeof(double) * h * h), h, h, h, -1, -1};
+    MatrixView y = {arena_alloc(sizeof(double) * h * h), h, h, h, -1, -1};
+    if (x.values == NULL || y.values == NULL){
+        arena_release(mark);
+        strassen(a, b, c, n);
+        return;
+    }
+
+    /* The schedule keeps every intermediate in the quadrants of C and two temporaries, X and Y. */
+    add_blocks(&a11, -1, &a21, &x);        /* S3 = A11 - A21 */
+    add_blocks(&b22, -1, &b12, &y);        /* T3 = B22 - B12 */
+    strassen(&x, &y, &c21, cutoff);        /* P7 = S3*T3 */
+    add_blocks(&a21, 1, &a22, &x);         /* S1 = A21 + A22 */
+    add_blocks(&b12, -1, &b11, &y);        /* T1 = B12 - B11 */
+    strassen(&x, &y, &c22, cutoff);        /* P5 = S1*T1 */
+    add_blocks(&x, -1, &a11, &x);          /* S2 = S1 - A11 */
+    add_blocks(&b22, -1, &y, &y);          /* T2 = B22 - T1 */
+    strassen(&x, &y, &c12, cutoff);        /* P6 = S2*T2 */
+    add_blocks(&a12, -1, &x, &x);          /* S4 = A12 - S2 */
+    strassen(&x, &b22, &c11, cutoff);      /* P3 = S4*B22 */
+    strassen(&a11, &b11, &x, cutoff);      /* P1 = A11*B11 */
+    add_blocks(&x, 1, &c12, &c12);         /* U2 = P1 + P6 */
+    add_blocks(&c12, 1, &c21, &c21);       /* U3 = U2 + P7 */
+    add_blocks(&c12, 1, &c22, &c12);       /* U4 = U2 + P5 */
+    add_blocks(&c21, 1, &c22, &c22);       /* C22 = U3 + P5 */
+    add_blocks(&c12, 1, &c11, &c12);       /* C12 = U4 + P3 */
+    add_blocks(&y, -1, &b21, &y);          /* T4 = T2 - B21 */
+    strassen(&a22, &y, &c11, cutoff);      /* P4 = A22*T4 */
+    add_blocks(&c21, -1, &c11, &c21);      /* C21 = U3 - P4 */
+    strassen(&a12, &b21, &c11, cutoff);    /* P2 = A12*B21 */
+    add_blocks(&x, 1, &c11, &c11);         /* C11 = P1 + P2 */
+
+    arena_release(mark);
+}
+
+/* Function to calculate the product of two square matrices of the same size with Strassen-Winograd,
+ * returning INVALID_MATRIX for any other matrices. */
+Error get_product_strassen(const Matrix *matrix1, const Matrix *matrix2, const int cutoff, Matrix **product){
+    if (matrix1->rows != matrix1->cols || matrix2->rows != matrix2->cols || matrix1->cols != matrix2->rows){
+        return INVALID_MATRIX;
+    }
+    Matrix *new_mat = allocate_matrix(matrix1->rows, matrix2->cols);
+    if (new_mat == NULL){
+        return MEMORY_ERROR;
+    }
+
+    const MatrixView a = view_matrix(matrix1), b = view_matrix(matrix2);
+    MatrixView c = view_matrix(new_mat);
+    strassen(&a, &b, &c, cutoff);
+
+    *product = new_mat;
+    return NO_ERROR;
+}
+
+/* Function to find the largest absolute value in a matrix. */
+static double get_max_norm(const Matrix *matrix){
+    double max = 0;
+
+    for (int i=0; i<matrix->rows; i++){
+        for (int j=0; j<matrix->cols; j++){
+            max = fmax(max, fabs(matrix->values[i*matrix->stride + j]));
+        }
+    }
+
+    return max;
+}
+
+/* Function to find the bounds on the largest error in any element of an n x n product, for the classical
+ * kernel and for Strassen-Winograd with the given cutoff (Higham, Accuracy and Stability of Numerical
+ * Algorithms, section 23.2). With u the unit roundoff and n0 the size the recursion stops at, they are
+ *     classical: n^2 u max|A| max|B|
+ *     Strassen-Winograd: ((n/n0)^log2(18) (n0^2 + 6 n0) - 6n) u max|A| max|B| */
+void find_product_error_bounds(const Matrix *matrix1, const Matrix *matrix2, const int cutoff,
+                               double *classical_bound, double *strassen_bound){
+    const double n = matrix1->rows;
+    const double scale = (DBL_EPSILON / 2) * get_max_norm(matrix1) * get_max_norm(matrix2);
+
+    /* Each level of recursion multiplies the constant by 18, and n0 is the size the recursion stops at. */
+    int n0 = matrix1->rows;
+    double growth = 1;
+    while (n0 > cutoff){
+        n0 /= 2;
+        growth *= 18;
+    }
+
+    *classical_bound = n * n * scale;
+    *strassen_bound = (growth * ((double) n0 * n0 + 6.0 * n0) - 6 * n) * scale;
+}
+
+/* Swaps two rows of a matrix in place. */
+static void swap_rows(Matrix *matrix, const int row1, const int row2){
+    double *a = &matrix->values[row1*matrix->stride];
+    double *b = &matrix->values[row2*matrix->stride];
+
+    for (int j=0; j<matrix->cols; j++){
+        double temp = a[j];
+        a[j] = b[j];
+        b[j] = temp;
+    }
+}
+
+/* Function to subtract a linear combination of rows from a row, over the columns [first_col, end_col):
+ * row -= coeffs[0]*rows[0] + ... + coeffs[count-1]*rows[count-1], where consecutive rows are stride apart.
+ * Four rows are applied per pass so each element of row is loaded and stored less often. */
+static void subtract_row_combination(double *row, const double *coeffs, const double *rows, const int count,
+                              const int stride, const int first_col, const int end_col){
+    int k = 0;
+
+    for (; k+4<=count; k+=4){
+        const double c0 = coeffs[k], c1 = coeffs[k+1], c2 = coeffs[k+2], c3 = coeffs[k+3];
+        const double *r0 = &rows[k*stride], *r1 = r0 + stride, *r2 = r1 + stride, *r3 = r2 + stride;
+        for (int j=first_col; j<end_col; j++){
+            row[j] -= c0*r0[j] + c1*r1[j] + c2*r2[j] + c3*r3[j];
+        }
+    }
+    for (; k<count; k++){
+        const double c = coeffs[k];
+        const double *r = &rows[k*stride];
+        if (c == 0){
+            continue;
+        }
+        for (int j=first_col; j<end_col; j++){
+            row[j] -= c * r[j];
+        }
+    }
+}
+
+/* Function to factorise one panel of columns [start, end) of the LU matrix, choosing the
+ * largest element in each column as the pivot. Rows are swapped across the whole matrix. */
+static void factorise_panel(LU *lu, const int start, const int end){
+    Matrix *a = lu->factors;
+    const int n = a->cols;
+    const int ld = a->stride;
+
+    for (int k=start; k<end; k++){
+        /* Finds the row with the largest absolute value in column k, on or below the diagonal. */
+        int pivot_row = k;
+        double pivot_abs = fabs(a->values[k*ld + k]);
+        for (int i=k+1; i<n; i++){
+            if (fabs(a->values[i*ld + k]) > pivot_abs){
+                pivot_abs = fabs(a->values[i*ld + k]);
+                pivot_row = i;
+            }
+        }
+
+        lu->pivots[k] = pivot_row;
+        if (pivot_row != k){
+            swap_rows(a, k, pivot_row);
+            lu->sign = -lu->sign;
+        }
+
+        /* A zero pivot means the column is already eliminated, so the matrix is singular. */
+        double pivot = a->values[k*ld + k];
+        if (pivot == 0){
+            continue;
+        }
+
+        /* Eliminates below the pivot, only updating the columns inside the panel. */
+        for (int i=k+1; i<n; i++){
+            double l = a->values[i*ld + k] / pivot;
+            a->values[i*ld + k] = l;
+            for (int j=k+1; j<end; j++){
+                a->values[i*ld + j] -= l * a->values[k*ld + j];
+            }
+        }
+    }
+}
+
+/* Function to apply a factorised panel [start, end) to the columns right of it.
+ * First solves for the U block in the panel rows, then subtracts L*U from the trailing matrix. */
+static void update_trailing(LU *lu, const int start, const int end){
+    Matrix *a = lu->factors;
+    const int n = a->cols;
+    const int ld = a->stride;
+
+    /* Forward substitution with the unit lower triangle of the panel. */
+    for (int i=start+1; i<end; i++){
+        subtract_row_combination(&a->values[i*ld], &a->values[i*ld + start], &a->values[start*ld],
+                                 i - start, ld, end, n);
+    }
+
+    /* Rank update of the trailing matrix, A22 -= L21*U12, which is a matrix product of blocks of the factors. */
+    const MatrixView factors = view_matrix(a);
+    const MatrixView l21 = view_block(&factors, end, start, n - end, end - start);
+    const MatrixView u12 = view_block(&factors, start, end, end - start, n - end);
+    MatrixView a22 = view_block(&factors, end, end, n - end, n - end);
+    gemm(-1, &l21, &u12, &a22);
+}
+
+/* Function to find the row and column scales that equilibrate the copied matrix of an LU structure before it
+ * is factorised, so every row and column of R*A*C has largest element 1, and the 1-norm of R*A*C.
+ * Zero rows and columns are left unscaled. */
+static void equilibrate_lu(LU *lu){
+    const Matrix *a = lu->factors;
+    const int n = a->cols;
+
+    for (int i=0; i<n; i++){
+        double max = 0;
+        for (int j=0; j<n; j++){
+            max = fmax(max, fabs(a->values[i*a->stride + j]));
+        }
+        lu->row_scales[i] = max == 0 ? 1 : 1 / max;
+    }
+
+    for (int j=0; j<n; j++){
+        double max = 0;
+        for (int i=0; i<n; i++){
+            max = fmax(max, fabs(a->values[i*a->stride + j]) * lu->row_scales[i]);
+        }
+        lu->col_scales[j] = max == 0 ? 1 : 1 / max;
+    }
+
+    lu->scaled_norm = 0;
+    for (int j=0; j<n; j++){
+        double sum = 0;
+        for (int i=0; i<n; i++){
+            sum += fabs(a->values[i*a->stride + j]) * lu->row_scales[i];
+        }
+        lu->scaled_norm = fmax(lu->scaled_norm, sum * lu->col_scales[j]);
+    }
+}
+
+/* Function to allocate an LU structure holding a copy of a square view, ready to be factorised in place.
+ * Returns NULL if there is not enough memory. */
+static LU *create_lu(const MatrixView *view){
+    const int n = view->rows;
+
+    LU *lu = malloc(sizeof(LU));
+    if (lu == NULL){
+        return NULL;
+    }
+    lu->pivots = malloc(sizeof(int) * n);
+    lu->col_pivots = NULL;
+    lu->sign = 1;
+    lu->row_scales = malloc(sizeof(double) * n);
+    lu->col_scales = malloc(sizeof(double) * n);
+
+    /* The factors are stored in a copy, so the viewed matrix is left untouched. */
+    lu->factors = allocate_matrix(n, n);
+    if (lu->pivots == NULL || lu->row_scales == NULL || lu->col_scales == NULL || lu->factors == NULL){
+        if (lu->factors != NULL){
+            free_matrix(lu->factors);
+        }
+        free(lu->pivots);
+        free(lu->row_scales);
+        free(lu->col_scales);
+        free(lu);
+        return NULL;
+    }
+    for (int i=0; i<n; i++){
+        const double *row = view_row(view, i);
+        double *copy = &lu->factors->values[i*lu->factors->stride];
+        for (int j=0; j<n; ){
+            const int run = view_run(view, j);
+            memcpy(&copy[j], &row[view_col_index(view, j)], sizeof(double) * run);
+            j += run;
+        }
+    }
+    equilibrate_lu(lu);
+
+    return lu;
+}
+
+/* Function to find the LU factorisation of a square view with partial pivoting, so that PA = LU.
+ * The view is factorised in panels of LU_BLOCK_SIZE columns to make good use of the cache.
+ * Returns INVALID_MATRIX if the view is not square. */
+Error factorise_lu_view(const MatrixView *view, LU **factorisation){
+    const int n = view->rows;
+    if (view->rows != view->cols){
+        return INVALID_MATRIX;
+    }
+    LU *lu = create_lu(view);
+    if (lu == NULL){
+        return MEMORY_ERROR;
+    }
+
+    for (int start=0; start<n; start+=LU_BLOCK_SIZE){
+        int end = start + LU_BLOCK_SIZE < n ? start + LU_BLOCK_SIZE : n;
+
+        factorise_panel(lu, start, end);
+        update_trailing(lu, start, end);
+    }
+
+    *factorisation = lu;
+    return NO_ERROR;
+}
+
+/* Function to find the LU factorisation of a square matrix with partial pivoting, as factorise_lu_view() does. */
+Error factorise_lu(const Matrix *matrix, LU **factorisation){
+    const MatrixView view = view_matrix(matrix);
+    return factorise_lu_view(&view, factorisation);
+}
+
+/* Swaps two columns of a matrix in place. */
+static void swap_cols(Matrix *matrix, const int col1, const int col2){
+    for (int i=0; i<matrix->rows; i++){
+        double temp = matrix->values[i*matrix->stride + col1];
+        matrix->values[i*matrix->stride + col1] = matrix->values[i*matrix->stride + col2];
+        matrix->values[i*matrix->stride + col2] = temp;
+    }
+}
+
+/* Function to find the LU factorisation of a square matrix with complete pivoting, so that PAQ = LU.
+ * The largest remaining element is used as each pivot, so the pivots never grow and reveal the rank.
+ * This is slower than factorise_lu(), so it is only used when the rank is needed. Returns NULL if there is
+ * not enough memory. */
+static LU *factorise_lu_complete(const Matrix *matrix){
+    const int n = matrix->rows;
+    const MatrixView view = view_matrix(matrix);
+    LU *lu = create_lu(&view);
+    if (lu == NULL){
+        return NULL;
+    }
+    Matrix *a = lu->factors;
+    const int ld = a->stride;
+
+    lu->col_pivots = malloc(sizeof(int) * n);
+    if (lu->col_pivots == NULL){
+        free_lu(lu);
+        return NULL;
+    }
+
+    for (int k=0; k<n; k++){
+        /* Finds the largest absolute value in the trailing matrix. */
+        int pivot_row = k, pivot_col = k;
+        double pivot_abs = -1;
+        for (int i=k; i<n; i++){
+            for (int j=k; j<n; j++){
+                if (fabs(a->values[i*ld + j]) > pivot_abs){
+                    pivot_abs = fabs(a->values[i*ld + j]);
+                    pivot_row = i;
+                    pivot_col = j;
+                }
+            }
+        }
+
+        lu->pivots[k] = pivot_row;
+        lu->col_pivots[k] = pivot_col;
+        if (pivot_row != k){
+            swap_rows(a, k, pivot_row);
+            lu->sign = -lu->sign;
+        }
+        if (pivot_col != k){
+            swap_cols(a, k, pivot_col);
+            lu->sign = -lu->sign;
+        }
+
+        /* If the largest element is 0, the rest of the matrix is already eliminated. */
+        double pivot = a->values[k*ld + k];
+        if (pivot == 0){
+            continue;
+        }
+
+        for (int i=k+1; i<n; i++){
+            double l = a->values[i*ld + k] / pivot;
+            a->values[i*ld + k] = l;
+            for (int j=k+1; j<n; j++){
+                a->values[i*ld + j] -= l * a->values[k*ld + j];
+            }
+        }
+    }
+
+    return lu;
+}
+
+/* Function to free the memory used to store an LU factorisation. */
+void free_lu(LU *lu){
+    free_matrix(lu->factors);
+    free(lu->pivots);
+    free(lu->col_pivots);
+    free(lu->row_scales);
+    free(lu->col_scales);
+    free(lu);
+}
+
+/* Function to find the determinant from an LU factorisation, the signed product of the pivots. */
+double lu_determinant(const LU *lu){
+    const int n = lu->factors->cols;
+    double det = lu->sign;
+
+    for (int i=0; i<n; i++){
+        det *= lu->factors->values[i*lu->factors->stride + i];
+    }
+
+    return det;
+}
+
+/* Function to check whether an LU factorisation has a zero pivot, meaning the matrix is singular.
+ * This is used instead of comparing the determinant to 0, which can underflow for large matrices. */
+int lu_is_singular(const LU *lu){
+    const int n = lu->factors->cols;
+
+    for (int i=0; i<n; i++){
+        if (lu->factors->values[i*lu->factors->stride + i] == 0){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Function to find the rank of a matrix from its completely pivoted LU factorisation, as the number of leading
+ * pivots that are not 0. Complete pivoting only leaves a pivot of exactly 0 once the trailing matrix is all 0. */
+static int lu_rank(const LU *lu){
+    const int n = lu->factors->cols;
+    int rank = 0;
+
+    while (rank < n && lu->factors->values[rank*lu->factors->stride + rank] != 0){
+        rank++;
+    }
+
+    return rank;
+}
+
+/* Function to find the inverse of a matrix from an LU factorisation with no zero pivots, by solving LUX = P
+ * with forward then backward substitution. Returns MEMORY_ERROR if there is not enough memory. */
+static Error solve_lu_inverse(const LU *lu, Matrix **inverse){
+    const int n = lu->factors->cols;
+    const double *f = lu->factors->values;
+    const int ldf = lu->factors->stride;
+    Matrix *inv_mat = allocate_matrix(n, n);
+    if (inv_mat == NULL){
+        return MEMORY_ERROR;
+    }
+    double *x = inv_mat->values;
+    const int ldx = inv_mat->stride;
+
+    /* Starts from the identity matrix with the same row swaps applied as during the factorisation. */
+    memset(x, 0, sizeof(double) * n * ldx);
+    for (int i=0; i<n; i++){
+        x[i*ldx + i] = 1;
+    }
+    for (int i=0; i<n; i++){
+        if (lu->pivots[i] != i){
+            swap_rows(inv_mat, i, lu->pivots[i]);
+        }
+    }
+
+    /* The right hand sides are solved in blocks of columns, so the block being solved stays in cache. */
+    for (int start=0; start<n; start+=SOLVE_BLOCK_SIZE){
+        const int end = start + SOLVE_BLOCK_SIZE < n ? start + SOLVE_BLOCK_SIZE : n;
+
+        /* Forward substitution with the unit lower triangle L. */
+        for (int i=1; i<n; i++){
+            subtract_row_combination(&x[i*ldx], &f[i*ldf], x, i, ldx, start, end);
+        }
+
+        /* Backward substitution with the upper triangle U, from the last row upwards. */
+        for (int i=n-1; i>=0; i--){
+            subtract_row_combination(&x[i*ldx], &f[i*ldf + i+1], &x[(i+1)*ldx], n-1 - i, ldx, start, end);
+            const double pivot = f[i*ldf + i];
+            for (int j=start; j<end; j++){
+                x[i*ldx + j] /= pivot;
+            }
+        }
+    }
+
+    *inverse = inv_mat;
+    return NO_ERROR;
+}
+
+/* Function to find the reciprocal condition number in the 1-norm of the equilibrated matrix R*A*C, given the
+ * inverse of A. Unlike the condition number of A itself, this does not grow when rows or columns of A are
+ * scaled, so a badly scaled but well determined matrix is not taken to be singular. */
+static double find_scaled_rcond(const LU *lu, const Matrix *inverse){
+    const int n = inverse->cols;
+    double inverse_norm = 0;
+
+    /* The inverse of R*A*C is C^-1*A^-1*R^-1. */
+    for (int j=0; j<n; j++){
+        double sum = 0;
+        for (int i=0; i<n; i++){
+            sum += fabs(inverse->values[i*inverse->stride + j]) / lu->col_scales[i];
+        }
+        inverse_norm = fmax(inverse_norm, sum / lu->row_scales[j]);
+    }
+
+    return 1 / (lu->scaled_norm * inverse_norm);
+}
+
+/* Function to find the inverse of a matrix from its LU factorisation. Returns INVALID_MATRIX if a pivot is 0,
+ * or if the matrix is singular to working precision: rounding seldom leaves a pivot of a singular matrix
+ * exactly 0, so the inverse is also rejected when the reciprocal condition number of the equilibrated
+ * matrix is below the machine epsilon. */
+Error lu_inverse(const LU *lu, Matrix **inverse){
+    if (lu_is_singular(lu)){
+        return INVALID_MATRIX;
+    }
+    Matrix *inv_mat;
+    Error error = solve_lu_inverse(lu, &inv_mat);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    /* Written so a NaN condition number is rejected too. */
+    if (!(find_scaled_rcond(lu, inv_mat) >= DBL_EPSILON)){
+        free_matrix(inv_mat);
+        return INVALID_MATRIX;
+    }
+
+    *inverse = inv_mat;
+    return NO_ERROR;
+}
+
+/* Function to find the determinant of any square view, such as a minor, without copying it first. */
+Error get_view_determinant(const MatrixView *view, double *determinant){
+    /* The determinant of an empty minor, left from a 1x1 matrix, is 1. */
+    if (view->rows == 0 && view->cols == 0){
+        *determinant = 1;
+        return NO_ERROR;
+    }
+
+    LU *lu;
+    Error error = factorise_lu_view(view, &lu);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    *determinant = lu_determinant(lu);
+    free_lu(lu);
+    return NO_ERROR;
+}
+
+/* Function to find the determinant of any square matrix. Used in other operations too. */
+Error get_determinant(const Matrix *matrix, double *determinant){
+    const MatrixView view = view_matrix(matrix);
+    return get_view_determinant(&view, determinant);
+}
+
+/* Function to find the cofactor of element (row, col) of a square matrix, the signed determinant of the minor
+ * viewed in place. Returns INCORRECT_ARGUMENTS if the element is outside the matrix. */
+Error get_cofactor(const Matrix *matrix, const int row, const int col, double *cofactor){
+    if (matrix->rows != matrix->cols){
+        return INVALID_MATRIX;
+    }
+    if (row < 0 || row >= matrix->rows || col < 0 || col >= matrix->cols){
+        return INCORRECT_ARGUMENTS;
+    }
+
+    const MatrixView view = view_matrix(matrix);
+    const MatrixView minor = view_minor(&view, row, col);
+    double det;
+    Error error = get_view_determinant(&minor, &det);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    *cofactor = (row + col) % 2 == 0 ? det : -det;
+    return NO_ERROR;
+}
+
+/* Function to find the adjoint of a matrix with rank n-1 from its completely pivoted factorisation PAQ = LU.
+ * Only the last pivot of U is 0, so adj(U) = x*e_n^T, where x is the null vector of U scaled by the
+ * determinant of the leading block of U. Then adj(A) = sign*Q*adj(U)*L^-1*P, which is an outer product.
+ * Returns NULL if there is not enough memory. */
+static Matrix *find_rank_one_adjoint(const LU *lu){
+    const int n = lu->factors->cols;
+    const double *f = lu->factors->values;
+    const int ld = lu->factors->stride;
+    Matrix *adj_mat = allocate_matrix(n, n);
+
+    const ArenaMark mark = arena_mark();
+    double *x = arena_alloc(sizeof(double) * n);
+    double *y = arena_alloc(sizeof(double) * n);
+    if (adj_mat == NULL || x == NULL || y == NULL){
+        if (adj_mat != NULL){
+            free_matrix(adj_mat);
+        }
+        arena_release(mark);
+        return NULL;
+    }
+
+    /* x = det(U11) * [-U11^-1 * u; 1], where u is the last column of U above the diagonal. */
+    double det = lu->sign;
+    for (int i=0; i<n-1; i++){
+        det *= f[i*ld + i];
+    }
+    x[n-1] = det;
+    for (int i=n-2; i>=0; i--){
+        double sum = 0;
+        for (int k=i+1; k<n; k++){
+            sum += f[i*ld + k] * x[k];
+        }
+        x[i] = -sum / f[i*ld + i];
+    }
+
+    /* y is the last row of L^-1, found by solving L^T y = e_n. */
+    y[n-1] = 1;
+    for (int i=n-2; i>=0; i--){
+        double sum = 0;
+        for (int k=i+1; k<n; k++){
+            sum += f[k*ld + i] * y[k];
+        }
+        y[i] = -sum;
+    }
+
+    /* Applies Q to x and P^T to y, undoing the swaps from the last step to the first. */
+    for (int k=n-1; k>=0; k--){
+        double temp = x[k];
+        x[k] = x[lu->col_pivots[k]];
+        x[lu->col_pivots[k]] = temp;
+
+        temp = y[k];
+        y[k] = y[lu->pivots[k]];
+        y[lu->pivots[k]] = temp;
+    }
+
+    for (int i=0; i<n; i++){
+        for (int j=0; j<n; j++){
+            adj_mat->values[i*adj_mat->stride + j] = x[i] * y[j];
+        }
+    }
+
+    arena_release(mark);
+    return adj_mat;
+}
+
+/* Function to find the adjoint of a matrix with full rank from its completely pivoted factorisation PAQ = LU,
+ * as the determinant multiplied by the inverse. lu_inverse() only undoes the row swaps, finding Q^T*A^-1, so the
+ * column swaps are undone on its rows, from the last to the first. Returns NULL if there is not enough memory. */
+static Matrix *find_full_rank_adjoint(const LU *lu){
+    const int n = lu->factors->cols;
+    Matrix *adj_mat;
+    if (solve_lu_inverse(lu, &adj_mat) != NO_ERROR){
+        return NULL;
+    }
+
+    for (int k=n-1; k>=0; k--){
+        if (lu->col_pivots[k] != k){
+            swap_rows(adj_mat, k, lu->col_pivots[k]);
+        }
+    }
+
+    const double det = lu_determinant(lu);
+    for (int i=0; i<n; i++){
+        for (int j=0; j<n; j++){
+            adj_mat->values[i*adj_mat->stride + j] *= det;
+        }
+    }
+
+    return adj_mat;
+}
+
+/* Function to find the adjoint of a matrix that had a zero pivot with partial pivoting, using a rank revealing
+ * factorisation. If complete pivoting finds no zero pivot, the adjoint is the determinant multiplied by the
+ * inverse. If the rank is n-1 it is an outer product, and if it is lower every cofactor is 0.
+ * Returns NULL if there is not enough memory. */
+static Matrix *find_singular_adjoint(const Matrix *matrix){
+    const int n = matrix->rows;
+    LU *lu = factorise_lu_complete(matrix);
+    Matrix *adj_mat;
+    if (lu == NULL){
+        return NULL;
+    }
+
+    const int rank = lu_rank(lu);
+    if (rank == n){
+        adj_mat = find_full_rank_adjoint(lu);
+    }
+    else if (rank == n-1){
+        adj_mat = find_rank_one_adjoint(lu);
+    }
+    else {
+        adj_mat = allocate_zero_matrix(n, n);
+    }
+
+    free_lu(lu);
+    return adj_mat;
+}
+
+/* Function to find the adjoint of a matrix from its LU factorisation with partial pivoting. */
+Error lu_adjoint(const Matrix *matrix, const LU *lu, Matrix **adjoint){
+    Matrix *adj_mat;
+
+    /* If 1x1 matrix, returns the adjoint as 1x1 matrix with the value 1. */
+    if (matrix->rows == 1){
+        adj_mat = allocate_matrix(matrix->rows, matrix->cols);
+        if (adj_mat == NULL){
+            return MEMORY_ERROR;
+        }
+        adj_mat->values[0] = 1;
+
+        *adjoint = adj_mat;
+        return NO_ERROR;
+    }
+
+    /* Unless a pivot is 0, the adjoint is the determinant multiplied by the inverse. This stays accurate even when
+     * a pivot is tiny, as the pivot divided out by the inverse is multiplied back in by the determinant. */
+    if (lu_is_singular(lu)){
+        adj_mat = find_singular_adjoint(matrix);
+        if (adj_mat == NULL){
+            return MEMORY_ERROR;
+        }
+
+        *adjoint = adj_mat;
+        return NO_ERROR;
+    }
+
+    double det = lu_determinant(lu);
+    Error error = solve_lu_inverse(lu, &adj_mat);
+    if (error != NO_ERROR){
+        return error;
+    }
+    for (int i=0; i<adj_mat->rows; i++){
+        for (int j=0; j<adj_mat->cols; j++){
+            adj_mat->values[i*adj_mat->stride + j] *= det;
+        }
+    }
+
+    *adjoint = adj_mat;
+    return NO_ERROR;
+}
+
+/* Function to find the adjiont of a square matrix. */
+Error get_adjoint(const Matrix *matrix, Matrix **adjoint){
+    LU *lu;
+    Error error = factorise_lu(matrix, &lu);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    error = lu_adjoint(matrix, lu, adjoint);
+    free_lu(lu);
+    return error;
+}
+
+/* Function to find the inverse of a square matrix, returning INVALID_MATRIX if it is singular to working precision. */
+Error get_inverse(const Matrix *matrix, Matrix **inverse){
+    /* The same factorisation is used to check the matrix is invertible and to find the inverse. */
+    LU *lu;
+    Error error = factorise_lu(matrix, &lu);
+    if (error != NO_ERROR){
+        return error;
+    }
+
+    error = lu_inverse(lu, inverse);
+    free_lu(lu);
+    return error;
+}
+
+/* Function to multiply two numbers of the form f * 2^e, rounding the product to a 64 bit significand. */
+static DiyFp multiply_diy_fp(const DiyFp x, const DiyFp y){
+    unsigned long long high, low;
+    multiply_64(x.f, y.f, &high, &low);
+
+    DiyFp product = {high + (low >> 63), x.e + y.e + 64};
+    return product;
+}
+
+/* Function to shift the significand of a non-zero number so that its highest bit is set. */
+static DiyFp normalise_diy_fp(DiyFp x){
+    const int shift = leading_zeros(x.f);
+    x.f <<= shift;
+    x.e -= shift;
+    return x;
+}
+
+/* Function to find 10^k to 64 bits, from the table of powers of five, as 10^k = 5^k * 2^k. */
+static DiyFp cached_power_of_ten(const int k){
+    const unsigned long long *power = POWERS_OF_FIVE[k - POWER_OF_FIVE_MIN];
+
+    DiyFp cached = {power[0] + (power[1] >> 63), (((152170 + 65536) * k) >> 16) - 63};
+    return cached;
+}
+
+/* Function to move the last digit down while that brings the digits closer to the exact value, and they
+ * still lie inside the boundaries. rest is how far the digits are below the upper boundary, distance is how
+ * far the value is, delta is the width of the interval, and ten_k is one unit of the last digit. */
+static void round_last_digit(char *digits, const int length, const unsigned long long distance,
+                      const unsigned long long delta, unsigned long long rest, const unsigned long long ten_k){
+    while (rest < distance && delta - rest >= ten_k
+           && (rest + ten_k < distance || distance - rest > rest + ten_k - distance)){
+        digits[length - 1]--;
+        rest += ten_k;
+    }
+}
+
+/* Function to generate the fewest digits that lie between the scaled boundaries lower and upper, which share
+ * an exponent between -60 and -32 so that the integer part of upper fits in 32 bits. Returns the number of
+ * digits, and adds to exponent the position of the last digit. */
+static int generate_digits(char *digits, int *exponent, const DiyFp lower, const DiyFp value, const DiyFp upper){
+    unsigned long long delta = upper.f - lower.f;
+    unsigned long long distance = upper.f - value.f;
+    const int shift = -upper.e;
+    const unsigned long long one = 1ULL << shift;
+
+    unsigned int integral = (unsigned int) (upper.f >> shift);
+    unsigned long long fractional = upper.f & (one - 1);
+    int length = 0;
+
+    unsigned int power = 1;
+    int power_digits = 1;
+    while (power_digits < 10 && integral / power >= 10){
+        power *= 10;
+        power_digits++;
+    }
+
+    /* Digits of the integer part are generated first, stopping as soon as the rest lies inside the interval. */
+    while (power_digits > 0){
+        digits[length++] = (char) ('0' + integral / power);
+        integral %= power;
+        power_digits--;
+
+        const unsigned long long rest = ((unsigned long long) integral << shift) + fractional;
+        if (rest <= delta){
+            *exponent += power_digits;
+            round_last_digit(digits, length, distance, delta, rest, (unsigned long long) power << shift);
+            return length;
+        }
+        power /= 10;
+    }
+
+    /* Then digits of the fractional part, scaling the interval with them. */
+    int fraction_digits = 0;
+    do {
+        fractional *= 10;
+        digits[length++] = (char) ('0' + (fractional >> shift));
+        fractional &= one - 1;
+        fraction_digits++;
+        delta *= 10;
+        distance *= 10;
+    } while (fractional > delta);
+
+    *exponent -= fraction_digits;
+    round_last_digit(digits, length, distance, delta, fractional, one);
+    return length;
+}
+
+/* Function to find the digits of a positive, finite double with the Grisu2 algorithm (Loitsch, Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers, 2010). The value and the halfway points to its
+ * neighbouring doubles are scaled by a power of ten so that they are 64 bit integers, and digits are generated
+ * until they lie between the halfway points. Sets exponent so the value is digits * 10^exponent, and returns
+ * the number of digits, at most 17. The digits always read back as the same double, and are the shortest
+ * that do in nearly every case. */
+static int grisu2(const double value, char *digits, int *exponent){
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(double));
+    const unsigned long long fraction = bits & ((1ULL << 52) - 1);
+    const int biased_exponent = (int) (bits >> 52) & 0x7FF;
+
+    DiyFp v;
+    if (biased_exponent == 0){
+        v.f = fraction;
+        v.e = 1 - 1075;
+    }
+    else {
+        v.f = fraction | (1ULL << 52);
+        v.e = biased_exponent - 1075;
+    }
+
+    /* The halfway point below is closer when the value is a power of two, as the gap below it is half the size. */
+    DiyFp upper = {(v.f << 1) + 1, v.e - 1};
+    DiyFp lower;
+    if (fraction == 0 && biased_exponent > 1){
+        lower.f = (v.f << 2) - 1;
+        lower.e = v.e - 2;
+    }
+    else {
+        lower.f = (v.f << 1) - 1;
+        lower.e = v.e - 1;
+    }
+    upper = normalise_diy_fp(upper);
+    lower.f <<= lower.e - upper.e;
+    lower.e = upper.e;
+    const DiyFp w = normalise_diy_fp(v);
+
+    /* Finds k = ceil((-61 - e) * log10(2)), so the scaled exponent is between -60 and -32. */
+    const int f = -61 - upper.e;
+    const int k = (f * 78913) / (1 << 18) + (f > 0);
+    const DiyFp cached = cached_power_of_ten(k);
+
+    /* Each scaled number may be out by one in the last place, so the interval is narrowed to stay inside it. */
+    const DiyFp scaled = multiply_diy_fp(w, cached);
+    DiyFp scaled_lower = multiply_diy_fp(lower, cached);
+    DiyFp scaled_upper = multiply_diy_fp(upper, cached);
+    scaled_lower.f++;
+    scaled_upper.f--;
+
+    *exponent = -k;
+    return generate_digits(digits, exponent, scaled_lower, scaled, scaled_upper);
+}
+
+/* Function to write the shortest string that reads back as the given double into buffer, which must have
+ * space for FORMATTED_DOUBLE_LENGTH characters. Numbers are written in the same form as %g, without a
+ * terminator, and the number of characters written is returned. */
+static int format_double(const double value, char *buffer){
+    if (isnan(value) || isinf(value)){
+        return snprintf(buffer, FORMATTED_DOUBLE_LENGTH, "%g", value);
+    }
+
+    int length = 0;
+    if (signbit(value)){
+        buffer[length++] = '-';
+    }
+    if (value == 0){
+        buffer[length++] = '0';
+        return length;
+    }
+
+    char digits[20];
+    int exponent;
+    const int digit_count = grisu2(fabs(value), digits, &exponent);
+    /* The number is 0.digits * 10^point. */
+    const int point = digit_count + exponent;
+
+    if (point > 15 || point < -3){
+        /* Scientific form, with at least two exponent digits as %g gives. */
+        buffer[length++] = digits[0];
+        if (digit_count > 1){
+            buffer[length++] = '.';
+            memcpy(&buffer[length], &digits[1], (size_t) digit_count - 1);
+            length += digit_count - 1;
+        }
+        const int power = abs(point - 1);
+        buffer[length++] = 'e';
+        buffer[length++] = point - 1 < 0 ? '-' : '+';
+        if (power >= 100){
+            buffer[length++] = (char) ('0' + power / 100);
+        }
+        buffer[length++] = (char) ('0' + power / 10 % 10);
+        buffer[length++] = (char) ('0' + power % 10);
+    }
+    else if (point >= digit_count){
+        memcpy(&buffer[length], digits, (size_t) digit_count);
+        length += digit_count;
+        memset(&buffer[length], '0', (size_t) (point - digit_count));
+        length += point - digit_count;
+    }
+    else if (point > 0){
+        memcpy(&buffer[length], digits, (size_t) point);
+        length += point;
+        buffer[length++] = '.';
+        memcpy(&buffer[length], &digits[point], (size_t) (digit_count - point));
+        length += digit_count - point;
+    }
+    else {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        memset(&buffer[length], '0', (size_t) -point);
+        length += -point;
+        memcpy(&buffer[length], digits, (size_t) digit_count);
+        length += digit_count;
+    }
+
+    return length;
+}
+
+/* Function run by each task of file_print_matrix(), writing a block of rows as text into the task's buffer. */
+static void format_rows(void *arg, const int index){
+    FormatTask *task = arg;
+    const Matrix *matrix = task->matrix;
+    const int start = task->first_row + index*task->block_rows;
+    const int end = start + task->block_rows < matrix->rows ? start + task->block_rows : matrix->rows;
+    char *buffer = &task->buffers[index*task->buffer_size];
+    size_t length = 0;
+
+    for (int i=start; i<end; i++){
+        for (int j=0; j<matrix->cols; j++){
+            length += format_double(matrix->values[i*matrix->stride + j], &buffer[length]);
+            buffer[length++] = '\t';
+        }
+        buffer[length++] = '\n';
+    }
+
+    task->lengths[index] = length;
+}
+
+/* Function to print the matrix elements to the file. Each element is written with the fewest digits that
+ * read back as exactly the same double. Blocks of rows are formatted into large buffers, one for each thread
+ * of the pool, and then the buffers are written to the file in order. */
+static Error file_print_matrix(FILE *f, const Matrix *matrix){
+    const size_t row_length = (size_t) matrix->cols * (FORMATTED_DOUBLE_LENGTH + 1) + 1;
+    const int block_count = pool != NULL && !in_pool_task ? pool->worker_count + 1 : 1;
+
+    FormatTask task;
+    task.matrix = matrix;
+    task.block_rows = OUTPUT_BUFFER_SIZE / row_length > 0 ? (int) (OUTPUT_BUFFER_SIZE / row_length) : 1;
+    task.buffer_size = task.block_rows * row_length;
+    const ArenaMark mark = arena_mark();
+    task.buffers = arena_alloc(task.buffer_size * block_count);
+    task.lengths = arena_alloc(sizeof(size_t) * block_count);
+    if (task.buffers == NULL || task.lengths == NULL){
+        arena_release(mark);
+        return MEMORY_ERROR;
+    }
+
+    /* States matrix and its rows and columns, as done in input files. */
+    fprintf(f, "matrix %d %d\n", matrix->rows, matrix->cols);
+    for (int i=0; i<matrix->rows; i+=task.block_rows*block_count){
+        const int remaining_blocks = (matrix->rows - i + task.block_rows - 1) / task.block_rows;
+        const int blocks = remaining_blocks < block_count ? remaining_blocks : block_count;
+
+        task.first_row = i;
+        run_parallel(pool, format_rows, &task, blocks);
+        for (int b=0; b<blocks; b++){
+            fwrite(&task.buffers[b*task.buffer_size], 1, task.lengths[b], f);
+        }
+    }
+
+    arena_release(mark);
+    return NO_ERROR;
+}
+
+/* Function to write the matrix to the file in the binary format, a header followed by the row major elements. */
+static Error file_write_binary_matrix(FILE *f, const Matrix *matrix){
+    unsigned char header[BINARY_HEADER_SIZE] = {0};
+    memcpy(header, BINARY_MAGIC, BINARY_MAGIC_LENGTH);
+    write_little_endian(&header[8], 4, BINARY_VERSION);
+    write_little_endian(&header[12], 4, BINARY_DTYPE_FLOAT64);
+    write_little_endian(&header[16], 4, BINARY_LAYOUT_ROW_MAJOR);
+    write_little_endian(&header[24], 8, (unsigned long long) matrix->rows);
+    write_little_endian(&header[32], 8, (unsigned long long) matrix->cols);
+    write_little_endian(&header[40], 8, BINARY_HEADER_SIZE);
+    fwrite(header, 1, BINARY_HEADER_SIZE, f);
+
+    /* A matrix without padding is written in one go, and others a row at a time to leave the padding out. */
+    if (is_little_endian()){
+        if (matrix->stride == matrix->cols){
+            fwrite(matrix->values, sizeof(double), (size_t) matrix->rows * matrix->cols, f);
+            return NO_ERROR;
+        }
+        for (int i=0; i<matrix->rows; i++){
+            fwrite(&matrix->values[i*matrix->stride], sizeof(double), (size_t) matrix->cols, f);
+        }
+        return NO_ERROR;
+    }
+
+    /* Other machines write a little-endian copy of each row. */
+    const ArenaMark mark = arena_mark();
+    double *row = arena_alloc(sizeof(double) * matrix->cols);
+    if (row == NULL){
+        return MEMORY_ERROR;
+    }
+    for (int i=0; i<matrix->rows; i++){
+        memcpy(row, &matrix->values[i*matrix->stride], sizeof(double) * matrix->cols);
+        swap_element_bytes(row, (size_t) matrix->cols);
+        fwrite(row, sizeof(double), (size_t) matrix->cols, f);
+    }
+    arena_release(mark);
+    return NO_ERROR;
+}
+
+/* Function to write a matrix to an open file, in the binary format or as text in the same way as the input
+ * file is given, with the command line arguments that made it in a comment. */
+Error write_matrix(FILE *f, const int argc, char *argv[], const Matrix *matrix, const int binary){
+    if (binary){
+        return file_write_binary_matrix(f, matrix);
+    }
+
+    /* Replicating how the input file is given.
+     * Prints command line arguments in first line of the file as a comment. */
+    fprintf(f, "# ");
+    for (int k=0; k<argc; k++) {
+        fprintf(f, "%s ", argv[k]);
+    }
+    fprintf(f, "\n# Version = %s, Revision date = %s\n", VERSION, REV_DATE);
+    Error error = file_print_matrix(f, matrix);
+    if (error != NO_ERROR){
+        return error;
+    }
+    fprintf(f, "end\n");
+    return NO_ERROR;
+}
@@ -0,0 +1,166 @@
+/*
+ Title:   Matrix Calculator, library
+ Author:  Jeremy Godden
+*/
+
+#ifndef MATRIXCALC_H
+#define MATRIXCALC_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ Public interface of libmatrixcalc, the matrix operations behind matrix_calc, for use in other programs.
+
+ Nothing in the library exits, or prints anywhere but the files it is given. Every function that can fail
+ returns an Error, and gives its result through its last arguments, which are only set when it returns
+ NO_ERROR. Matrices found by the library are owned by the caller and freed with free_matrix().
+
+ start_matrix_calc() must be called once before anything else, and stop_matrix_calc() once at the end.
+ In between, the functions can be called from any number of threads at once, as long as no matrix is
+ changed while it is being used. Large operations share the threads of one pool, and operations started
+ while it is busy, or from inside one of its tasks, run on the calling thread.
+
+ Each thread keeps the scratch memory it needs in an arena, and the small matrices it frees in a pool for
+ reuse, which last until the thread exits, or until stop_matrix_calc() for the thread that calls it.
+*/
+
+#define MAX_ROWS_COLS 2000 /* Maximum size of matrix in file. */
+#define INVALID_TOKEN_LENGTH 256 /* Longest part of an invalid token kept to be shown in the error message. */
+#define STRASSEN_CUTOFF 1024 /* Default size below which Strassen-Winograd uses the classical kernel. */
+
+/* Flags for set_matrix_placement(), saying how the values of large matrices, of at least 4 MB, are placed.
+ * PLACE_HUGE_PAGES maps each one on its own, advised to use transparent huge pages, so products spend less time
+ * on TLB misses. PLACE_FIRST_TOUCH zeroes each one on the threads of the pool, in the tiles products share out,
+ * so that on a NUMA machine its pages are spread over the memory nodes of the threads that work on them. */
+#define PLACE_HUGE_PAGES 1
+#define PLACE_FIRST_TOUCH 2
+
+/* Defined values for the binary matrix file format. A file starts with a header of BINARY_HEADER_SIZE bytes:
+ *     bytes 0-7    magic, BINARY_MAGIC
+ *     bytes 8-11   version, BINARY_VERSION
+ *     bytes 12-15  element type, BINARY_DTYPE_FLOAT64 for IEEE 754 doubles
+ *     bytes 16-19  layout, BINARY_LAYOUT_ROW_MAJOR or BINARY_LAYOUT_COL_MAJOR
+ *     bytes 20-23  reserved, 0
+ *     bytes 24-31  rows
+ *     bytes 32-39  columns
+ *     bytes 40-47  offset of the elements from the start of the file, a multiple of 8
+ *     bytes 48-63  reserved, 0
+ * All values are unsigned little-endian integers. The elements are little-endian, and written straight after
+ * the header, so they start 64 byte aligned when the file is mapped into memory. */
+#define BINARY_MAGIC "\x89MATRIX\n"
+#define BINARY_MAGIC_LENGTH 8
+#define BINARY_VERSION 1
+#define BINARY_HEADER_SIZE 64
+#define BINARY_DTYPE_FLOAT64 1
+#define BINARY_LAYOUT_ROW_MAJOR 0
+#define BINARY_LAYOUT_COL_MAJOR 1
+
+/* Constants for giving out errors. */
+typedef enum error{
+    NO_ERROR = 0,
+    INCORRECT_ARGUMENTS = 1,
+    MEMORY_ERROR = 2,
+    FILE_OPEN_ERROR = 3,
+    INVALID_FILE = 4,
+    INVALID_MATRIX = 5,
+} Error;
+
+/* Structure for the context of an error in reading a file: the file, and if it is invalid, why and where. The
+ * functions that read files fill it in, and keep their position in the file to themselves. */
+typedef struct context{
+    char *file_name;
+    int binary; /* Whether the file is in the binary matrix format. */
+    const char *message; /* Why the file is invalid, once reading it has failed. */
+    int line_number; /* The line the file was found to be invalid at. */
+    char invalid_token[INVALID_TOKEN_LENGTH]; /* Copy of the token the file was found to be invalid at. */
+    int invalid_token_length; /* -1 if there was no token. */
+} Context;
+
+/* Structure to hold information about a matrix. Rows are stored one after another, stride elements apart, so
+ * element (i, j) is values[i*stride + j]. The elements between the end of a row and the start of the next are
+ * padding, which is never read. */
+typedef struct matrix{
+    int rows;
+    int cols;
+    int stride; /* Elements between the starts of consecutive rows, at least cols. */
+    double *values;
+    void *mapping; /* The mapped file holding the values, or NULL if they were allocated. */
+    size_t mapping_size;
+} Matrix;
+
+/* Structure for a view of a block of a matrix, which is read and written in place rather than copied. Row i of
+ * the view is row i of the block, or row i+1 from skip_row on, and column j is found in the same way from
+ * skip_col, so a minor can be viewed by leaving out one row and one column. Either is -1 if nothing is left out.
+ * The view does not own its values, which must stay allocated while it is used. */
+typedef struct matrix_view{
+    double *values; /* Element (0, 0) of the block. */
+    int rows;
+    int cols;
+    int stride;
+    int skip_row;
+    int skip_col;
+} MatrixView;
+
+/* The LU factorisation of a square matrix, kept so it can be used for more than one operation. */
+typedef struct lu LU;
+
+/* Setting up the library. threads is the number of threads used for large matrices, counting the caller's. */
+Error start_matrix_calc(int threads);
+void stop_matrix_calc(void);
+void set_matrix_placement(int flags);
+void run_tasks(void (*task)(void *arg, int index), void *arg, int task_count);
+
+/* Creating and freeing matrices. allocate_matrix() returns NULL if there is not enough memory. A matrix and its
+ * values are allocated together, and must be freed with free_matrix(). The values start on a 64 byte boundary,
+ * and the rows of matrices at least that wide are padded so that each does too, and so that their stride is not
+ * a large power of two. */
+Matrix *allocate_matrix(int rows, int cols);
+void free_matrix(Matrix *matrix);
+
+/* Viewing blocks and minors of matrices. view_minor() needs a view that does not already leave anything out. */
+MatrixView view_matrix(const Matrix *matrix);
+MatrixView view_block(const MatrixView *view, int row, int col, int rows, int cols);
+MatrixView view_minor(const MatrixView *view, int row, int col);
+double *view_element(const MatrixView *view, int row, int col);
+
+/* Reading matrices from text or binary files. If INVALID_FILE is returned, the context says why. */
+Error load_matrix(char *file_name, Matrix **matrix, Context *context);
+Error load_matrix_buffer(char *name, char *data, size_t size, Matrix **matrix, Context *context);
+Error stream_frob_norm(char *file_name, double *norm, Context *context);
+void describe_load_error(char *buffer, size_t size, Error error, const Context *context);
+
+/* Operations on matrices. Those that need a square matrix, or matrices that can be multiplied, return
+ * INVALID_MATRIX for any others, as get_inverse() and lu_inverse() do for matrices that are singular to
+ * working precision once their rows and columns are scaled. */
+Error get_frob_norm(const Matrix *matrix, double *norm);
+Error get_determinant(const Matrix *matrix, double *determinant);
+Error get_transpose(const Matrix *matrix, Matrix **transpose);
+Error transpose_in_place(Matrix *matrix);
+Error get_product(const Matrix *matrix1, const Matrix *matrix2, Matrix **product);
+Error get_product_strassen(const Matrix *matrix1, const Matrix *matrix2, int cutoff, Matrix **product);
+Error get_view_product(const MatrixView *view1, const MatrixView *view2, Matrix **product);
+Error get_view_determinant(const MatrixView *view, double *determinant);
+Error get_cofactor(const Matrix *matrix, int row, int col, double *cofactor);
+void find_product_error_bounds(const Matrix *matrix1, const Matrix *matrix2, int cutoff,
+                               double *classical_bound, double *strassen_bound);
+Error get_adjoint(const Matrix *matrix, Matrix **adjoint);
+Error get_inverse(const Matrix *matrix, Matrix **inverse);
+
+/* Operations sharing one LU factorisation of a square matrix. */
+Error factorise_lu(const Matrix *matrix, LU **lu);
+Error factorise_lu_view(const MatrixView *view, LU **lu);
+double lu_determinant(const LU *lu);
+int lu_is_singular(const LU *lu);
+Error lu_inverse(const LU *lu, Matrix **inverse);
+Error lu_adjoint(const Matrix *matrix, const LU *lu, Matrix **adjoint);
+void free_lu(LU *lu);
+
+/* Writing matrices. write_matrix() writes the text format, with argv in a comment, or the binary format.
+ * print_matrix() writes just the elements, for checking them by eye. */
+Error write_matrix(FILE *f, int argc, char *argv[], const Matrix *matrix, int binary);
+void print_matrix(FILE *f, const Matrix *matrix);
+unsigned long long read_little_endian(const unsigned char *bytes, int length);
+void write_little_endian(unsigned char *bytes, int length, unsigned long long value);
+
+#endif
@@ -0,0 +1,215 @@
+/*
+ Title:   Matrix Calculator, inverse and adjoint tests
+ Author:  Jeremy Godden
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "matrixcalc.h"
+
+/* Function to make an n x n matrix from its elements in row order, returning NULL if there is not enough memory. */
+Matrix *make_matrix(const int n, const double *elements){
+    Matrix *matrix = allocate_matrix(n, n);
+    if (matrix == NULL){
+        return NULL;
+    }
+    for (int i=0; i<n; i++){
+        for (int j=0; j<n; j++){
+            matrix->values[i*matrix->stride + j] = elements[i*n + j];
+        }
+    }
+    return matrix;
+}
+
+/* Function to check that inverting a matrix gives the expected error, returning 1 if it does. */
+int check_inverse_error(const char *name, const int n, const double *elements, const Error expected){
+    Matrix *matrix = make_matrix(n, elements);
+    Matrix *inverse = NULL;
+    Error error = matrix == NULL ? MEMORY_ERROR : get_inverse(matrix, &inverse);
+
+    if (error == NO_ERROR){
+        free_matrix(inverse);
+    }
+    if (matrix != NULL){
+        free_matrix(matrix);
+    }
+    if (error != expected){
+        fprintf(stderr, "%s: expected error %d, got %d\n", name, expected, error);
+        return 0;
+    }
+    return 1;
+}
+
+/* Function to check that the inverse of a matrix times the matrix is the identity, returning 1 if it is. */
+int check_inverse_identity(const char *name, const int n, const double *elements){
+    Matrix *matrix = make_matrix(n, elements);
+    Matrix *inverse = NULL, *product = NULL;
+    int passed = matrix != NULL && get_inverse(matrix, &inverse) == NO_ERROR
+                 && get_product(inverse, matrix, &product) == NO_ERROR;
+
+    for (int i=0; passed && i<n; i++){
+        for (int j=0; j<n; j++){
+            if (fabs(product->values[i*product->stride + j] - (i == j)) > 1e-12){
+                passed = 0;
+            }
+        }
+    }
+
+    if (product != NULL){
+        free_matrix(product);
+    }
+    if (inverse != NULL){
+        free_matrix(inverse);
+    }
+    if (matrix != NULL){
+        free_matrix(matrix);
+    }
+    if (!passed){
+        fprintf(stderr, "%s: inverse times matrix is not the identity\n", name);
+    }
+    return passed;
+}
+
+/* Function to check that each element of an n x n result is within rounding error of the expected element,
+ * relative to its size, so badly scaled results are checked as closely as well scaled ones. Expected zeros
+ * must be found exactly. Returns 1 if they all are. */
+int check_elements(const char *name, const Matrix *result, const int n, const double *expected){
+    for (int i=0; i<n; i++){
+        for (int j=0; j<n; j++){
+            const double value = result->values[i*result->stride + j];
+            if (fabs(value - expected[i*n + j]) > 1e-12 * fabs(expected[i*n + j])){
+                fprintf(stderr, "%s: element (%d, %d) is %.17g, expected %.17g\n", name, i, j, value,
+                        expected[i*n + j]);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Function to check that the inverse of a matrix is the expected matrix, returning 1 if it is. */
+int check_inverse(const char *name, const int n, const double *elements, const double *expected){
+    Matrix *matrix = make_matrix(n, elements);
+    Matrix *inverse = NULL;
+    Error error = matrix == NULL ? MEMORY_ERROR : get_inverse(matrix, &inverse);
+    int passed = error == NO_ERROR && check_elements(name, inverse, n, expected);
+
+    if (error != NO_ERROR){
+        fprintf(stderr, "%s: expected the inverse, got error %d\n", name, error);
+    }
+    if (inverse != NULL){
+        free_matrix(inverse);
+    }
+    if (matrix != NULL){
+        free_matrix(matrix);
+    }
+    return passed;
+}
+
+/* Function to check that the adjoint of a matrix is the expected matrix, returning 1 if it is. */
+int check_adjoint(const char *name, const int n, const double *elements, const double *expected){
+    Matrix *matrix = make_matrix(n, elements);
+    Matrix *adjoint = NULL;
+    Error error = matrix == NULL ? MEMORY_ERROR : get_adjoint(matrix, &adjoint);
+    int passed = error == NO_ERROR && check_elements(name, adjoint, n, expected);
+
+    if (error != NO_ERROR){
+        fprintf(stderr, "%s: expected the adjoint, got error %d\n", name, error);
+    }
+    if (adjoint != NULL){
+        free_matrix(adjoint);
+    }
+    if (matrix != NULL){
+        free_matrix(matrix);
+    }
+    return passed;
+}
+
+/* Function to check that the adjoint of an invertible matrix is its determinant times its inverse,
+ * returning 1 if it is. */
+int check_adjoint_inverse(const char *name, const int n, const double *elements){
+    Matrix *matrix = make_matrix(n, elements);
+    Matrix *inverse = NULL, *adjoint = NULL;
+    double *expected = malloc(sizeof(double) * n * n);
+    double det;
+    int passed = matrix != NULL && expected != NULL && get_determinant(matrix, &det) == NO_ERROR
+                 && get_inverse(matrix, &inverse) == NO_ERROR && get_adjoint(matrix, &adjoint) == NO_ERROR;
+
+    if (passed){
+        for (int i=0; i<n; i++){
+            for (int j=0; j<n; j++){
+                expected[i*n + j] = det * inverse->values[i*inverse->stride + j];
+            }
+        }
+        passed = check_elements(name, adjoint, n, expected);
+    }
+    else {
+        fprintf(stderr, "%s: could not find the determinant, inverse and adjoint\n", name);
+    }
+
+    if (adjoint != NULL){
+        free_matrix(adjoint);
+    }
+    if (inverse != NULL){
+        free_matrix(inverse);
+    }
+    if (matrix != NULL){
+        free_matrix(matrix);
+    }
+    free(expected);
+    return passed;
+}
+
+int main(void){
+    /* Singular integer matrices whose LU factorisations round to a pivot near 0, rather than exactly 0. */
+    static const double SINGULAR_3[] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+    static const double SINGULAR_4[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    static const double ZERO_ROW[] = {1, 2, 0, 0};
+    static const double INVERTIBLE[] = {4, 7, 2, 3, 6, 1, 2, 5, 3};
+
+    /* Exactly invertible matrices that are badly scaled, so their pivots differ by many orders of magnitude. */
+    static const double SCALED_2[] = {1e20, 0, 0, 1};
+    static const double SCALED_2_INVERSE[] = {1e-20, 0, 0, 1};
+    static const double SCALED_2_ADJOINT[] = {1, 0, 0, 1e20};
+    static const double SCALED_3[] = {1e9, 0, 0, 0, 1, 0, 0, 0, 1e-9};
+    static const double SCALED_3_INVERSE[] = {1e-9, 0, 0, 0, 1, 0, 0, 0, 1e9};
+
+    /* D1*INVERTIBLE*D2 with D1 = diag(1e10, 1, 1e-10) and D2 = diag(1e-8, 1, 1e8), which has determinant 9,
+     * adjoint D2^-1*adj(INVERTIBLE)*D1^-1, and is well conditioned once its rows and columns are scaled. */
+    static const double EQUILIBRATED[] = {4e2, 7e10, 2e18, 3e-8, 6, 1e8, 2e-18, 5e-10, 3e-2};
+    static const double EQUILIBRATED_ADJOINT[] = {13e-2, -11e8, -5e18, -7e-10, 8, 2e10, 3e-18, -6e-8, 3e2};
+    static const double EQUILIBRATED_INVERSE[] = {13e-2 / 9, -11e8 / 9, -5e18 / 9, -7e-10 / 9, 8.0 / 9, 2e10 / 9,
+                                                  3e-18 / 9, -6e-8 / 9, 3e2 / 9};
+
+    /* Matrices of rank n-1, whose adjoints are the outer product of their null vectors. */
+    static const double SINGULAR_3_ADJOINT[] = {-3, 6, -3, 6, -12, 6, -3, 6, -3};
+    static const double ZERO_ROW_ADJOINT[] = {0, -2, 0, 1};
+
+    if (start_matrix_calc(1) != NO_ERROR){
+        return 1;
+    }
+
+    int passed = 1;
+    passed &= check_inverse_error("singular 3x3", 3, SINGULAR_3, INVALID_MATRIX);
+    passed &= check_inverse_error("singular 4x4", 4, SINGULAR_4, INVALID_MATRIX);
+    passed &= check_inverse_error("zero row", 2, ZERO_ROW, INVALID_MATRIX);
+    passed &= check_inverse_identity("invertible 3x3", 3, INVERTIBLE);
+
+    passed &= check_inverse("scaled 2x2 inverse", 2, SCALED_2, SCALED_2_INVERSE);
+    passed &= check_inverse("scaled 3x3 inverse", 3, SCALED_3, SCALED_3_INVERSE);
+    passed &= check_inverse("equilibrated 3x3 inverse", 3, EQUILIBRATED, EQUILIBRATED_INVERSE);
+    passed &= check_adjoint("scaled 2x2 adjoint", 2, SCALED_2, SCALED_2_ADJOINT);
+    passed &= check_adjoint("scaled 3x3 adjoint", 3, SCALED_3, SCALED_3_INVERSE);
+    passed &= check_adjoint("equilibrated 3x3 adjoint", 3, EQUILIBRATED, EQUILIBRATED_ADJOINT);
+
+    passed &= check_adjoint_inverse("invertible 3x3 adjoint", 3, INVERTIBLE);
+    passed &= check_adjoint_inverse("equilibrated 3x3 adjoint", 3, EQUILIBRATED);
+
+    passed &= check_adjoint("singular 3x3 adjoint", 3, SINGULAR_3, SINGULAR_3_ADJOINT);
+    passed &= check_adjoint("zero row adjoint", 2, ZERO_ROW, ZERO_ROW_ADJOINT);
+
+    stop_matrix_calc();
+    return passed ? 0 : 1;
+}